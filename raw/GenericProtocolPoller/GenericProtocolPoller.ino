@@ -1,18 +1,35 @@
+#include "src/sony_md_capture.h"
+
 /*
  * Generic protocol raw dumper
  * Barry Carter 2022 <barry.carter@gmail.com> 
  *  
  * Read from a single pin and dump the data
  * 
- * Capture each pulse, encode it as text and send it to the host for decoding
- * Not massively useful on its own, but will create a basic csv to parse
+ * Every edge is timestamped with the cycle counter from a pin interrupt
+ * into a RAM ring. loop() turns them into varint deltas (see
+ * src/sony_md_capture.h) and sends them in big USB writes, so nothing is
+ * lost while it's sending, and hours can be captured:
+ *  cat /dev/ttyACM0 > session.mde
+ * then md_trace_decode session.mde
+ * 
+ * Set TRACE_CSV for the old text csv, for raw/parse_md_protocol.py
  */
 
 // we make an assumption that the protocol is going to be delimited
 #define END_MSG_TIMEOUT_US 6500
 #define TRACE_DATA_PIN     3
 
-String buf = "";
+#ifndef TRACE_CSV
+#define TRACE_CSV          0
+#endif
+
+#if TRACE_CSV
+// a frame is ~250 pulses, at most 7 chars each. Sent early if it fills up
+#define TRACE_BUF_LEN      2048
+
+char buf[TRACE_BUF_LEN];
+int buf_len = 0;
 
 volatile unsigned long startTime = 0;
 
@@ -33,20 +50,19 @@ void waitLevel(boolean level) {
 
   // set the line levels as "-PREVIOUS_DURATION,+PREVIOUS...
   // csv delimited
-  if (level == LOW) {
-    buf.concat("-");
-  } else if (level == HIGH) {
-    buf.concat("+");
-  }
-
-  buf.concat(pulseLen);
-  buf.concat(",");
+  buf_len += snprintf(&buf[buf_len], TRACE_BUF_LEN - buf_len, "%c%lu,", level == LOW ? '-' : '+', pulseLen);
 
   // we got a timeout between packets. Send to the host
   if (pulseLen > END_MSG_TIMEOUT_US) {
-    Serial.println(buf);
+    Serial.write(buf, buf_len);
+    Serial.println();
     // start the message with a # so the host can process it
-    buf = "#";
+    buf[0] = '#';
+    buf_len = 1;
+  } else if (buf_len > TRACE_BUF_LEN - 16) {
+    // no room for another, send what we have. The host carries on from here
+    Serial.write(buf, buf_len);
+    buf_len = 0;
   }
 }
 
@@ -55,3 +71,155 @@ void loop() {
   waitLevel(LOW);
   waitLevel(HIGH);
 }
+
+#else
+// edges waiting for loop(). Power of 2. 32K of RAM buys ~1/3s of the busiest bus
+#define CAP_RING_LEN       8192
+// send when this much is waiting, or it has waited CAP_FLUSH_US
+#define CAP_OUT_LEN        2048
+#define CAP_FLUSH_US       20000
+
+#ifdef F_CPU_ACTUAL
+#define CAP_CLOCK_HZ       F_CPU_ACTUAL
+#else
+#define CAP_CLOCK_HZ       F_CPU
+#endif
+// a delta can't get near wrapping the cycle counter, say how long we were idle before it does
+#define CAP_IDLE_TICKS     (1UL << 30)
+
+// where the ring was full, so loop() can mark the lost edges in the right
+// place. Power of 2. Once these run out they all go on the last one
+#define CAP_LOSS_LEN       8
+
+// cycle count, with the line level after the edge in bit 0
+uint32_t cap_ring[CAP_RING_LEN];
+volatile uint16_t cap_head;
+uint16_t cap_tail;
+
+// edges that didn't fit, just before the one that went in at cap_ring[at]
+typedef struct cap_loss_t {
+  uint16_t at;
+  uint32_t edges;
+} cap_loss_t;
+
+cap_loss_t cap_loss[CAP_LOSS_LEN];
+volatile uint8_t cap_loss_head;
+uint8_t cap_loss_tail;
+
+uint8_t out[CAP_OUT_LEN];
+uint16_t out_len;
+unsigned long last_flush;
+
+uint32_t last_tick;
+uint8_t last_level;
+
+void capture_isr() {
+  uint32_t t = (ARM_DWT_CYCCNT & ~1UL) | digitalReadFast(TRACE_DATA_PIN);
+  uint16_t head = cap_head;
+  if ((uint16_t)(head - cap_tail) >= CAP_RING_LEN) {
+    uint8_t loss_head = cap_loss_head;
+    cap_loss_t *loss = &cap_loss[(uint8_t)(loss_head - 1) & (CAP_LOSS_LEN - 1)];
+    // still full from last time, or nowhere left to say where
+    if (loss_head != cap_loss_tail &&
+        (loss->at == head || (uint8_t)(loss_head - cap_loss_tail) >= CAP_LOSS_LEN)) {
+      loss->edges++;
+      return;
+    }
+    loss = &cap_loss[loss_head & (CAP_LOSS_LEN - 1)];
+    loss->at = head;
+    loss->edges = 1;
+    cap_loss_head = loss_head + 1;
+    return;
+  }
+  cap_ring[head & (CAP_RING_LEN - 1)] = t;
+  cap_head = head + 1;
+}
+
+void flush_out() {
+  Serial.write(out, out_len);
+  out_len = 0;
+  last_flush = micros();
+}
+
+void setup() {
+  Serial.begin(115200);
+  pinMode(TRACE_DATA_PIN, INPUT);
+  // the cycle counter isn't always running
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  // nothing to send it to until the host opens the port
+  while (!Serial) {
+  }
+
+  md_cap_header_t header;
+  memcpy(header.magic, MD_CAP_MAGIC, sizeof(header.magic));
+  header.version = MD_CAP_VERSION;
+  header.pin = TRACE_DATA_PIN;
+  header.reserved = 0;
+  header.clock_hz = CAP_CLOCK_HZ;
+#if defined(KINETISK) || defined(__IMXRT1062__)
+  header.start_time = rtc_get();
+#else
+  header.start_time = 0;
+#endif
+
+  noInterrupts();
+  last_tick = ARM_DWT_CYCCNT & ~1UL;
+  last_level = digitalReadFast(TRACE_DATA_PIN);
+  attachInterrupt(digitalPinToInterrupt(TRACE_DATA_PIN), capture_isr, CHANGE);
+  interrupts();
+  header.level = last_level;
+  header.start_tick = last_tick;
+  Serial.write((const uint8_t *)&header, sizeof(header));
+}
+
+void loop() {
+  while (cap_tail != cap_head) {
+    uint32_t t = cap_ring[cap_tail & (CAP_RING_LEN - 1)];
+
+    // the ring was full just before this one went in
+    uint32_t lost = 0;
+    noInterrupts();
+    while (cap_loss_tail != cap_loss_head && cap_loss[cap_loss_tail & (CAP_LOSS_LEN - 1)].at == cap_tail) {
+      lost += cap_loss[cap_loss_tail & (CAP_LOSS_LEN - 1)].edges;
+      cap_loss_tail++;
+    }
+    interrupts();
+    cap_tail++;
+
+    // or an edge came too quick for the interrupt, so it saw the same
+    // level twice. Two of those in a row look like nothing happened
+    uint8_t level = t & 1;
+    if (lost || level == last_level) {
+      out[out_len++] = 0;
+      out[out_len++] = MD_CAP_ESC_LOST;
+      out_len += md_cap_put_varint(&out[out_len], lost ? lost : 1);
+      out[out_len++] = level;
+    }
+
+    uint32_t tick = t & ~1UL;
+    uint32_t delta = tick - last_tick;
+    out_len += md_cap_put_varint(&out[out_len], delta ? delta : 1);
+    last_tick = tick;
+    last_level = level;
+
+    if (out_len > CAP_OUT_LEN - 16)
+      flush_out();
+  }
+
+  // quiet for a long time. Nothing not in the ring yet can be older than now
+  noInterrupts();
+  uint32_t now = ARM_DWT_CYCCNT & ~1UL;
+  bool empty = cap_tail == cap_head;
+  interrupts();
+  if (empty && now - last_tick > CAP_IDLE_TICKS) {
+    out[out_len++] = 0;
+    out[out_len++] = MD_CAP_ESC_IDLE;
+    out_len += md_cap_put_varint(&out[out_len], now - last_tick);
+    last_tick = now;
+  }
+
+  if (out_len && (out_len > CAP_OUT_LEN - 16 || micros() - last_flush > CAP_FLUSH_US))
+    flush_out();
+}
+#endif
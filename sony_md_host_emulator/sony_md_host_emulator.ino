@@ -48,7 +48,8 @@ void setup() {
 
   while (1) {
     md_loop();
-    if (md_send_get_cmd() == 128)
+    // the remote is up, whatever else it wants
+    if (md_send_get_cmd() & (1 << MD_HEADER_REMOTE_IS_INIT))
       break;
     delayMicroseconds(30000);
   }
@@ -109,7 +110,7 @@ Serial.println("CAP 2");
   _do_send_recv();
   Serial.println("CAP 5");
   delayMicroseconds(30000);
-  char *buf = md_get_send_buf();
+  char *buf = (char *)md_get_send_buf();
 
   md_request_capabilities(5);
   delayMicroseconds(30000);
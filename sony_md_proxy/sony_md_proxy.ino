@@ -0,0 +1,46 @@
+#include "src/sony_md_remote.h"
+
+/*
+ * Sony MD Remote example
+ * Barry Carter 2022 <barry.carter@gmail.com> 
+ *  
+ * Sit between the player and its remote, passing everything through
+ * 
+ * The player goes on MD_DATA_PIN, the remote on pin 5. Build with
+ * MD_RECV_USE_ISR or MD_SEND_ASYNC, or frames get missed while sending.
+ * Text going to the remote is shouted, and how long frames took to get
+ * through is dumped every few seconds
+ * 
+ */
+md_bus_t remote_bus;
+md_proxy_t proxy;
+unsigned long last_stamp = 0;
+
+void setup() {
+  Serial.begin(115200);
+  Serial.println("MD proxy");
+  md_bus_init(&remote_bus, 5, 5);
+  md_proxy_setup(&proxy, &md_bus_default, &remote_bus);
+}
+
+void loop() {
+  md_proxy_loop(&proxy);
+
+  if (millis() - last_stamp > 5000) {
+    md_proxy_stats_t stats;
+    md_proxy_get_stats(&proxy, &stats);
+    Serial.printf("to remote %u to player %u late %u delay us %u/%u/%u\n",
+      stats.to_remote, stats.to_player, stats.late,
+      stats.delay_us_min, stats.delay_us_avg, stats.delay_us_max);
+    last_stamp = millis();
+  }
+}
+
+// every frame on its way through
+bool md_proxy_rewrite_cb(uint8_t dir, uint8_t *data, uint8_t len) {
+  if (dir == MD_PROXY_TO_REMOTE && data[0] == CMD_TEXT) {
+    for (int i = REG_TEXT_POSITION; i < REG_TEXT_POSITION + REG_TEXT_LEN; i++)
+      data[i] = toupper(data[i]);
+  }
+  return true;
+}
@@ -10,12 +10,16 @@
  * gets the text and then switches to time
  * 
  */
+void md_changed(const md_event_t *event, void *ctx);
+
 void setup() {
   md_setup();
   // Turn on the receiver
   md_recv_enable(1);
   Serial.begin(115200);
   Serial.println("MD test");  
+  // only redraw when something actually changes, not for every packet
+  md_event_subscribe(MD_EVENT_ALL, md_changed, NULL);
 }
 
 void loop() {
@@ -24,8 +28,8 @@ void loop() {
 }
 
 // Example callbacks from the md player
-// we can do some processing when we get a packet, or decode some text.
-void md_packet_just_received_cb(uint8_t *packet) {
+// called with each value the player changes, or some new text
+void md_changed(const md_event_t *, void *) {
   // Dump a fake display to serial for debugging purposes
   md_display();
 }
@@ -2,7 +2,8 @@
  * Sony MD Remote Receiver
  * Barry Carter 2022 <barry.carter@gmail.com> 
  *  
- *  Read packets from the MD player in polling mode.
+ *  Read packets from the MD player, either by polling the pin or from a
+ *  pin change interrupt (MD_RECV_USE_ISR).
  *  
  *  handles r/w to the device etc
  * 
@@ -10,157 +11,351 @@
 #include "sony_md_remote.h"
 #if MD_ENABLE_RECV
 
-static uint8_t _prev_level;
-static uint8_t _state;
-static unsigned long _recv_started;
-static unsigned long _pulse_duration;
-static unsigned long _recv_ended;
-static uint8_t _byte_buf[30];
-static uint8_t _byte_idx;
-#if DUMP_MD_PACKET
-static String _tmp_prnt_buf;
-#endif
-static uint8_t _md_recv_send_byte = 0;
-static uint8_t _md_recv_send_buf[10];
-static uint8_t _md_recv_send_len = 0;
-
-static void _md_process_start();
-static void _decode_md_protocol();
-void _poll_pin_change(int level);
+// this bus' receiver, see md_recv_t
+#define _recv (_md_bus->recv)
+
+
+static bool _md_recv_edge(uint8_t level, unsigned long duration);
+static bool _md_recv_timeout();
+static void _md_recv_start_frame();
+static void _md_recv_end_frame();
+static void _md_recv_write_back(uint8_t data, uint8_t bit);
+#if !MD_RECV_USE_ISR
 static void _gather_packets();
-static void _md_recv_send_packet();
+#endif
+static int8_t _md_recv_process_frame(uint8_t *buf, uint8_t len);
 
 void md_recv_set_mode(uint8_t mode) {
-  _md_recv_send_byte |= 1 << mode;
+  _recv.send_byte |= 1 << mode;
 }
 
 void md_recv_clear_mode(uint8_t mode) {
-  _md_recv_send_byte &= ~(1 << mode);
+  _recv.send_byte &= ~(1 << mode);
 }
 
 enum MdDecode_state {
   _stateWaitingForStart,
-  _stateResetLow,
   _statePackets,
+  // the host gave us the bus, it's clocking our packet out of us
+  _stateSending,
 };
 
-// Given a positive pulse/sync start, get us to the end of the start message
+// We just saw a reset pulse. Get ready to skip past the start bit
 // and then gather the bytes up
-static void _md_process_start() {
-  // reset pulse
-  _state = _statePackets;
-  // skip past the start bit
-  _poll_pin_change(LOW);
-  _poll_pin_change(HIGH);
-  _poll_pin_change(LOW);
-  _poll_pin_change(HIGH);
-  
-  _prev_level = 1;
+static void _md_recv_start_frame() {
+  _recv.state = _statePackets;
+  // skip past the start bit, one falling and one rising edge
+  _recv.skip_edges = 2;
+  _recv.bit_counter = 0;
+  _recv.tmp_data = 0;
+  _recv.byte_idx = 0;
+
   // if we have data to send, flag we want to send it.
-  if (_md_recv_send_len) {
+  if (_recv.send_len)
     md_recv_set_mode(MD_HEADER_REMOTE_TX_READY);
-    Serial.println("TXR");
-  }
   else 
     md_recv_clear_mode(MD_HEADER_REMOTE_TX_READY);
-
-  _gather_packets();
 }
 
-// Sit and wait for a reset pulse. If there is no reset, this just returns
-// If we get a reset, the packets are gathered into the buffer
-static void _decode_md_protocol() {
-  if (_state == _stateResetLow) {
-    _md_process_start();
+// queue the bytes we have gathered for md_recv_loop()
+// if it has fallen too far behind, this one is lost
+static void _md_recv_end_frame() {
+  if (!_recv.byte_idx)
     return;
+
+  uint8_t depth = (uint8_t)(_recv.frame_head - _recv.frame_tail);
+  if (depth >= MD_RECV_RING_LEN) {
+    _recv.ring_stats.dropped++;
+  } else {
+    md_frame_t *frame = &_recv.frame_ring[_recv.frame_head & (MD_RECV_RING_LEN - 1)];
+    frame->stamp = _recv.ended;
+    frame->len = _recv.byte_idx;
+    memcpy(frame->data, _recv.byte_buf, _recv.byte_idx);
+    // make sure the frame is all there before the consumer can see it
+    __sync_synchronize();
+    _recv.frame_head++;
+    _recv.ring_stats.queued++;
+    if (depth + 1 > _recv.ring_stats.max_depth)
+      _recv.ring_stats.max_depth = depth + 1;
   }
-  _state = _stateWaitingForStart;
-  _gather_packets();
+  _recv.byte_idx = 0;
 }
 
-// sit and wait for a pin to toggle
-void _poll_pin_change(int level) {
-  while(digitalReadFast(MD_DATA_PIN) == level);;
+// @returns the oldest frame waiting, or NULL. It stays put until _md_recv_pop_frame()
+static md_frame_t *_md_recv_peek_frame() {
+  if (_recv.frame_head == _recv.frame_tail)
+    return NULL;
+  __sync_synchronize();
+  return &_recv.frame_ring[_recv.frame_tail & (MD_RECV_RING_LEN - 1)];
 }
 
-// get all of the bits and bytes for a full packet
-static void _gather_packets() {
-  volatile uint8_t tmp_data = 0;
-  volatile uint8_t _bit_counter = 0;
-  _byte_idx = 0;
-  
-  while(1) {
-    if (_state != _statePackets && _state != _stateWaitingForStart) {
-      break;
+// hand the slot back to the producer
+static void _md_recv_pop_frame() {
+  __sync_synchronize();
+  _recv.frame_tail++;
+  _recv.ring_stats.parsed++;
+}
+
+// sit and wait for a pin to toggle, but not forever
+bool _poll_pin_change(int level, unsigned long timeout_us) {
+  unsigned long start = micros();
+  while(digitalReadFast(_md_bus->data_pin) == level) {
+    if (micros() - start > timeout_us)
+      return false;
+  }
+  return true;
+}
+
+// The line has not moved for END_MSG_TIMEOUT_US. Whatever we have is all we
+// are getting, so hand it over and wait for the next reset.
+// @returns true if that finished a frame
+static bool _md_recv_timeout() {
+  if (_recv.state != _statePackets)
+    return false;
+
+  // stuck part way through a byte, rather than a NOP that just ended
+  if (_recv.bit_counter || _recv.skip_edges)
+    _recv.stats.line_timeouts++;
+
+  bool done = _recv.byte_idx > 0;
+  _md_recv_end_frame();
+  _recv.state = _stateWaitingForStart;
+  _recv.skip_edges = 0;
+  _recv.bit_counter = 0;
+  _recv.tmp_data = 0;
+  return done;
+}
+
+// keep track of how long we actually held the line for
+static void _md_recv_count_wb(unsigned long held_us) {
+  int32_t jitter = (int32_t)held_us - MD_PULSE_LONG_US;
+  _recv.stats.write_backs++;
+  if (_recv.stats.write_backs == 1 || jitter < _recv.stats.wb_jitter_us_min)
+    _recv.stats.wb_jitter_us_min = jitter;
+  if (_recv.stats.write_backs == 1 || jitter > _recv.stats.wb_jitter_us_max)
+    _recv.stats.wb_jitter_us_max = jitter;
+  _recv.wb_jitter_total += jitter;
+  _recv.stats.wb_jitter_us_avg = _recv.wb_jitter_total / (int32_t)_recv.stats.write_backs;
+}
+
+#if MD_RECV_WB_TIMER
+// timer is up, let go of the line
+static void _md_recv_wb_release() {
+  pinMode(_md_bus->data_pin, INPUT);
+  _recv.wb_timer.end();
+  _md_recv_count_wb(micros() - _recv.wb_started);
+  _recv.wb_active = false;
+}
+MD_BUS_TRAMPOLINES(_md_recv_wb_release);
+#endif
+
+// During the first "bit" we can set to write mode and send
+// some modal data. Same again for each byte of our packet, once we have the bus
+static void _md_recv_write_back(uint8_t data, uint8_t bit) {
+  if (data & (1 << bit)) {
+#if MD_RECV_WB_TIMER
+    // still holding the last one
+    if (_recv.wb_active)
+      return;
+    _recv.wb_active = true;
+    _recv.wb_started = micros();
+    pinMode(_md_bus->data_pin, OUTPUT);
+    digitalWrite(_md_bus->data_pin, HIGH);
+    _recv.wb_timer.begin(_md_recv_wb_release_trampolines[_md_bus->id], MD_PULSE_LONG_US);
+#else
+    unsigned long start = micros();
+    pinMode(_md_bus->data_pin, OUTPUT);
+    digitalWrite(_md_bus->data_pin, HIGH);
+    delayMicroseconds(MD_PULSE_LONG_US);
+    pinMode(_md_bus->data_pin, INPUT);
+    _md_recv_count_wb(micros() - start);
+#endif
+  }
+}
+
+// The host is reading our packet, like the header: a start bit then
+// 8 clocked bits for each of the bytes and the parity. Write back the
+// bits as they come. The start bits are skipped like the frame's
+static void _md_recv_send_edge(uint8_t level) {
+  if (level == 0) {
+    uint8_t data = _recv.tx_idx < _recv.send_len ? _recv.send_buf[_recv.tx_idx] :
+      md_calculate_parity(_recv.send_buf, _recv.send_len);
+    _md_recv_write_back(data, _recv.bit_counter);
+    return;
+  }
+
+  if (++_recv.bit_counter < 8)
+    return;
+  _recv.bit_counter = 0;
+  _recv.skip_edges = 2;
+  if (_recv.tx_idx++ < _recv.send_len)
+    return;
+
+  // all gone, wait for the next reset
+  _recv.send_len = 0;
+  _recv.state = _stateWaitingForStart;
+}
+
+// Decode a single edge. level is the new level of the line, and duration
+// is how long (us) it sat at the old level for.
+// This is shared by the polling and the interrupt receivers, so both decode
+// exactly the same way.
+// @returns true once a frame has been handed over to md_recv_loop()
+static bool _md_recv_edge(uint8_t level, unsigned long duration) {
+#if MD_RECV_CALIBRATE
+  // only the low pulses matter, they decide the bits and the resets
+  if (_recv.calib_running && level == 1 && _recv.calib_samples < MD_RECV_CALIB_SAMPLES) {
+    unsigned long bucket = duration / MD_RECV_CALIB_BUCKET_US;
+    if (bucket >= MD_RECV_CALIB_BUCKETS)
+      bucket = MD_RECV_CALIB_BUCKETS - 1;
+    if (_recv.calib_hist[bucket] < 0xFFFF)
+      _recv.calib_hist[bucket]++;
+    _recv.calib_samples++;
+  }
+#endif
+
+  // hmm we got a reset while harvesting bits
+  if (level == 1 
+      && duration > _recv.thresholds.reset_low_us_min 
+      && duration < _recv.thresholds.reset_low_us_max) {
+    if (_recv.bit_counter > 3) {
+      MD_LOG(MD_LOG_INFO, MD_LOG_TAG_RECV_RESET, &_recv.bit_counter, 1);
+      _recv.stats.resets_mid_byte++;
     }
-    
-    int level = digitalRead(MD_DATA_PIN);
+    bool done = _recv.byte_idx > 0;
+    _md_recv_end_frame();
+    _md_recv_start_frame();
+    return done;
+  }
 
-    // move along
-    if (_prev_level == level)
-      continue;
-  
-    _prev_level = level;    
-    _recv_ended = micros();
+  // nothing happened for ages, the frame before this edge is long over
+  bool done = false;
+  if (duration > END_MSG_TIMEOUT_US)
+    done = _md_recv_timeout();
+
+  if (_recv.skip_edges) {
+    _recv.skip_edges--;
+    return done;
+  }
+
+  if (_recv.state == _statePackets
+       && level == 0 
+       && _recv.send_byte 
+       && !_recv.passive
+       && _recv.byte_idx == 0) {
+    _md_recv_write_back(_recv.send_byte, _recv.bit_counter);
+  }
+
+  if (_recv.state == _stateSending) {
+    _md_recv_send_edge(level);
+    return done;
+  }
+
+  // just waiting for a reset, don't bother with the bits
+  if (_recv.state != _statePackets)
+    return done;
   
-    // get the _pulse_duration
-    _pulse_duration = _recv_ended - _recv_started;
-    _recv_started = _recv_ended;
-
-    // hmm we got a reset while harvesting bits
-    if (level == 1 
-        && _pulse_duration > RESET_LOW_US_MIN 
-        && _pulse_duration < RESET_LOW_US_MAX) {
-      _state = _stateResetLow;
-      if (_bit_counter > 3) {
-        Serial.print("RST! ");
-        Serial.println(_bit_counter);
-      }
-      continue;
-    }
+  // set the bit if the high pulse is long
+  if (level == 1 && duration < _recv.thresholds.pulse_on_us_min) {
+      _recv.tmp_data |= (1 << _recv.bit_counter);
+  }
 
-    // During the first "bit" we can set to write mode and send
-    // some modal data
-    if (_state == _statePackets
-         && level == 0 
-         && _md_recv_send_byte 
-         && _byte_idx == 0) {
-      if (_md_recv_send_byte & (1 << _bit_counter)) {
-        pinMode(MD_DATA_PIN, OUTPUT);
-        digitalWrite(MD_DATA_PIN, HIGH);
-        delayMicroseconds(MD_PULSE_LONG_US);
-        pinMode(MD_DATA_PIN, INPUT);
-      }
-    }
-    
-    // set the bit if the high pulse is long
-    if (level == 1 && _pulse_duration < PULSE_WIDTH_ON_US_MIN) {
-        tmp_data |= (1 << _bit_counter);
-    }
+  if (level == 1)
+    _recv.bit_counter++;
 
-    if (level == 1)
-      _bit_counter++;
+  // we got a whole byte, bank it
+  if (_recv.bit_counter >= 8) {
+    _recv.bit_counter = 0;
+    _recv.byte_buf[_recv.byte_idx++] = _recv.tmp_data;
+    _recv.tmp_data = 0;
 
-    // we got a whole byte, bank it
-    if (_bit_counter >= 8) {
-      _bit_counter = 0;
-      _byte_buf[_byte_idx] = tmp_data;      
-      _byte_idx++;
-      
-      // Stop when we have a full 10 byte packet (plus header and parity)
-      if (_byte_idx >= 13)
-        _state = _stateWaitingForStart;
+    // the host read our TX_READY and gave us the bus. It starts clocking
+    // straight after its header, so answer now, not from md_recv_loop()
+    if (_recv.byte_idx == 2
+        && (_recv.byte_buf[1] & (1 << MD_HEADER_HOST_BUS_AVAIL))
+        && _recv.send_len
+        && !_recv.passive) {
+      _md_recv_end_frame();
+      _recv.state = _stateSending;
+      _recv.tx_idx = 0;
+      _recv.skip_edges = 2;
+      // and don't stop listening, the bits start any moment
+      return false;
+    }
 
-      tmp_data = 0;
+    // Stop when we have a full 10 byte packet (plus header and parity)
+    // anything else until the next reset is ignored
+    if (_recv.byte_idx >= MD_RECV_FRAME_LEN) {
+      _md_recv_end_frame();
+      _recv.state = _stateWaitingForStart;
+      return true;
     }
   }
+  return done;
 }
 
-static void _md_recv_send_packet() {  
-  // wait for pulse 0 before each send of a byte
-  md_send_data(MD_DATA_PIN, _md_recv_send_buf, _md_recv_send_len, 1);
-  _md_recv_send_len = 0;
+#if MD_RECV_USE_ISR
+// pin change interrupt. timestamp the edge and decode it straight away
+static void _md_recv_isr() {
+#if MD_RECV_WB_TIMER
+  // that's us holding the line up, not the host
+  if (_recv.wb_active)
+    return;
+#endif
+  uint8_t level = digitalReadFast(_md_bus->data_pin);
+  if (_recv.prev_level == level)
+    return;
+
+  _recv.prev_level = level;
+  _recv.ended = micros();
+  _recv.pulse_duration = _recv.ended - _recv.started;
+  _recv.started = _recv.ended;
+
+  _md_recv_edge(level, _recv.pulse_duration);
 }
+MD_BUS_TRAMPOLINES(_md_recv_isr);
+#else
+// Get the bits and bytes for a packet. The decoder keeps its place between
+// calls, so this returns once a frame is done, the line has gone quiet, or
+// we have used up MD_RECV_POLL_BUDGET_US, whichever is first
+static void _gather_packets() {
+  unsigned long start = micros();
+  while(1) {
+#if MD_RECV_WB_TIMER
+    // that's us holding the line up, not the host. The timer lets go
+    if (_recv.wb_active) {
+      yield();
+      continue;
+    }
+#endif
+    int level = digitalReadFast(_md_bus->data_pin);
+    unsigned long tnow = micros();
+
+    // move along
+    if (_recv.prev_level == level) {
+      // the frame has stopped, either it's over or the line is stuck
+      if (_recv.state == _statePackets && tnow - _recv.started > END_MSG_TIMEOUT_US) {
+        _md_recv_timeout();
+        break;
+      }
+      // keep listening for the next reset, but not forever
+      if (tnow - start > MD_RECV_POLL_BUDGET_US)
+        break;
+      continue;
+    }
+  
+    _recv.prev_level = level;    
+    _recv.ended = tnow;
+  
+    // get the pulse duration
+    _recv.pulse_duration = _recv.ended - _recv.started;
+    _recv.started = _recv.ended;
+
+    if (_md_recv_edge(level, _recv.pulse_duration))
+      break;
+  }
+}
+#endif
 
 // given a 10 byte data array, crunch the parity
 uint8_t md_calculate_parity(uint8_t *data, uint8_t byte_count) {
@@ -172,68 +367,361 @@ uint8_t md_calculate_parity(uint8_t *data, uint8_t byte_count) {
 }
 
 uint8_t *md_recv_get_send_buf() {
-  memset(_md_recv_send_buf, 0, 10);
-  return _md_recv_send_buf;
+  memset(_recv.send_buf, 0, 10);
+  return _recv.send_buf;
 }
 
 void md_recv_set_send_len(uint8_t len) {
-  _md_recv_send_len = len;
+  _recv.send_len = len;
 }
 
 void md_recv_setup() {
-  pinMode(MD_DATA_PIN, INPUT);
+  pinMode(_md_bus->data_pin, INPUT);
+  _recv.prev_level = digitalReadFast(_md_bus->data_pin);
+  _recv.started = micros();
   // tell the md we are ready
   md_recv_set_mode(MD_HEADER_REMOTE_IS_INIT);
+#if MD_RECV_USE_ISR
+  attachInterrupt(digitalPinToInterrupt(_md_bus->data_pin), _md_recv_isr_trampolines[_md_bus->id], CHANGE);
+#endif
 }
 
-void md_recv_loop()
-{
+// deal with a whole frame from the player
+// @returns the MD_FRAME_ status
+static int8_t _md_recv_process_frame(uint8_t *buf, uint8_t len) {
   int parity = 0;
-  _decode_md_protocol();
-  if (_byte_idx > 0) {
-    // Check the header is valid:
-    if (!(_byte_buf[1] & (1 << MD_HEADER_HOST_HOST_READY))) {
-      //MD_SERIAL_PORT.println("Host not ready");
-      return;
-    }
-    
-    if (_byte_buf[1] & (1 << MD_HEADER_HOST_BUS_AVAIL)) {
-      if (_md_recv_send_len) {
-        _md_recv_send_packet();
-      }
-      return;
-    }
+  // only the first byte of the header. treat it as a sync
+  if (len < 2)
+    return MD_FRAME_NOP;
 
-    // The device continually sends just a header, like a sync I guess
-    if (_byte_idx <= 2) {
-      //MD_SERIAL_PORT.println("NOP");
-      return;
+  // Check the header is valid:
+  if (!(buf[1] & (1 << MD_HEADER_HOST_HOST_READY))) {
+    //MD_SERIAL_PORT.println("Host not ready");
+    return MD_FRAME_NOT_READY;
+  }
+  
+  // the decoder has already sent ours, if we had one
+  if (buf[1] & (1 << MD_HEADER_HOST_BUS_AVAIL))
+    return MD_FRAME_BUS_AVAIL;
+
+  // The device continually sends just a header, like a sync I guess
+  if (len <= 2) {
+    //MD_SERIAL_PORT.println("NOP");
+    return MD_FRAME_NOP;
+  }
+
+  MD_LOG(MD_LOG_DEBUG, MD_LOG_TAG_RECV_FRAME, buf, len);
+
+  // the player stopped before the whole packet arrived
+  if (len < MD_RECV_FRAME_LEN)
+    return MD_FRAME_TRUNCATED;
+
+#if MD_CALC_RECV_PARITY
+  parity = md_calculate_parity(&buf[2], 10);
+  if (buf[12] != parity) {
+    uint8_t parities[2] = { buf[12], (uint8_t)parity };
+    MD_LOG(MD_LOG_WARN, MD_LOG_TAG_RECV_PARITY, parities, sizeof(parities));
+    return MD_FRAME_BAD_PARITY;
+  }
+#endif
+
+  // callback
+  md_packet_just_received_cb(&buf[2]);
+#if MD_ENABLE_PROXY && MD_ENABLE_SEND
+  // pass it on, the real remote does the answering
+  if (_md_bus->proxy) {
+    _md_proxy_from_player(&buf[2], _recv.parse_frame.stamp);
+    return MD_FRAME_OK;
+  }
+#endif
+  // parse the packet data
+  md_packet_parse(&buf[2]);
+  return MD_FRAME_OK;
+}
+
+#if MD_RECV_CALIBRATE
+// a bucket and its neighbours, so a hump split over two buckets is still one hump
+static uint32_t _md_calib_count(uint16_t bucket) {
+  uint32_t count = _recv.calib_hist[bucket];
+  if (bucket > 0)
+    count += _recv.calib_hist[bucket - 1];
+  if (bucket + 1 < MD_RECV_CALIB_BUCKETS)
+    count += _recv.calib_hist[bucket + 1];
+  return count;
+}
+
+// the busiest bucket in [from, to)
+static uint16_t _md_calib_peak(uint16_t from, uint16_t to) {
+  uint16_t peak = from;
+  for (uint16_t i = from; i < to; i++) {
+    if (_md_calib_count(i) > _md_calib_count(peak))
+      peak = i;
+  }
+  return peak;
+}
+
+// the busiest bucket in [from, to) that is a peak of its own, i.e. the
+// histogram dips to half of it or less on the way to the peak we already have
+static uint16_t _md_calib_other_peak(uint16_t peak, uint16_t from, uint16_t to) {
+  uint16_t best = peak;
+  for (uint16_t i = from; i < to; i++) {
+    uint32_t count = _md_calib_count(i);
+    if (i == peak || !count)
+      continue;
+    if (best != peak && count <= _md_calib_count(best))
+      continue;
+
+    uint16_t lo = i < peak ? i : peak;
+    uint16_t hi = i < peak ? peak : i;
+    uint32_t dip = count;
+    for (uint16_t j = lo; j <= hi; j++) {
+      if (_md_calib_count(j) < dip)
+        dip = _md_calib_count(j);
     }
+    if (dip <= count / 2)
+      best = i;
+  }
+  return best;
+}
 
-#if DUMP_MD_PACKET
-    for(int i = 0; i < _byte_idx; i++) {
-      _tmp_prnt_buf.concat(_byte_buf[i]);
-      _tmp_prnt_buf.concat(",");
+// the middle of the emptiest stretch between two peaks
+static uint16_t _md_calib_valley(uint16_t from, uint16_t to) {
+  uint16_t best = from + 1;
+  uint16_t best_len = 0;
+  for (uint16_t i = from + 1; i < to; ) {
+    uint16_t run = i;
+    while (run < to && _recv.calib_hist[run] == _recv.calib_hist[i])
+      run++;
+    if (_recv.calib_hist[i] < _recv.calib_hist[best]
+        || (_recv.calib_hist[i] == _recv.calib_hist[best] && run - i > best_len)) {
+      best = i;
+      best_len = run - i;
     }
-    MD_SERIAL_PORT.println(_tmp_prnt_buf);
-    _tmp_prnt_buf = "!";
+    i = run;
+  }
+  return best + best_len / 2;
+}
+
+// how far (us) the nearest pulse we saw was from a threshold bucket
+static uint16_t _md_calib_margin(uint16_t bucket) {
+  uint16_t dist = 0;
+  while (dist < MD_RECV_CALIB_BUCKETS) {
+    if ((bucket >= dist && _recv.calib_hist[bucket - dist])
+        || (bucket + dist < MD_RECV_CALIB_BUCKETS && _recv.calib_hist[bucket + dist]))
+      break;
+    dist++;
+  }
+  return dist * MD_RECV_CALIB_BUCKET_US;
+}
+
+// we have enough pulses. find the 1s, the 0s and the resets, and put the
+// thresholds in the gaps between them
+static void _md_calib_finish() {
+  md_recv_thresholds_t t;
+  // the bits are all well short of a reset, and the last bucket is the overflow
+  uint16_t bits_end = RESET_LOW_US_MIN / MD_RECV_CALIB_BUCKET_US;
+  uint16_t top = MD_RECV_CALIB_BUCKETS - 1;
+
+  // the two busiest humps under a reset are the 1s and the 0s
+  uint16_t one_peak = _md_calib_peak(0, bits_end);
+  uint16_t zero_peak = _md_calib_other_peak(one_peak, 0, bits_end);
+  if (zero_peak < one_peak) {
+    uint16_t tmp = zero_peak;
+    zero_peak = one_peak;
+    one_peak = tmp;
+  }
+  uint16_t reset_peak = _md_calib_other_peak(zero_peak, zero_peak + 1, top);
+
+  // not enough of a signal to go on, keep what we have
+  if (one_peak == zero_peak || reset_peak == zero_peak)
+    return;
+
+  uint16_t on_bucket = _md_calib_valley(one_peak, zero_peak);
+  uint16_t reset_bucket = _md_calib_valley(zero_peak, reset_peak);
+
+  // resets are as wide above the peak as below it, but never outside what
+  // the protocol allows
+  uint16_t reset_max_bucket = 2 * reset_peak - reset_bucket + 1;
+  if (reset_bucket * MD_RECV_CALIB_BUCKET_US < RESET_LOW_US_MIN)
+    reset_bucket = (RESET_LOW_US_MIN + MD_RECV_CALIB_BUCKET_US - 1) / MD_RECV_CALIB_BUCKET_US;
+  if (reset_max_bucket > RESET_LOW_US_MAX / MD_RECV_CALIB_BUCKET_US)
+    reset_max_bucket = RESET_LOW_US_MAX / MD_RECV_CALIB_BUCKET_US;
+  // the peak was nowhere near a real reset
+  if (reset_bucket >= reset_max_bucket || on_bucket >= reset_bucket)
+    return;
+
+  t.pulse_on_us_min = on_bucket * MD_RECV_CALIB_BUCKET_US;
+  t.reset_low_us_min = reset_bucket * MD_RECV_CALIB_BUCKET_US;
+  t.reset_low_us_max = reset_max_bucket * MD_RECV_CALIB_BUCKET_US;
+  t.margin_us = _md_calib_margin(on_bucket);
+  if (_md_calib_margin(reset_bucket) < t.margin_us)
+    t.margin_us = _md_calib_margin(reset_bucket);
+  if (_md_calib_margin(reset_max_bucket) < t.margin_us)
+    t.margin_us = _md_calib_margin(reset_max_bucket);
+  t.samples = _recv.calib_samples;
+  md_recv_set_thresholds(&t);
+}
+
+// pick new thresholds once the histogram is full
+static void _md_calib_update() {
+  if (!_recv.calib_running || _recv.calib_samples < MD_RECV_CALIB_SAMPLES)
+    return;
+
+  _md_calib_finish();
+  if (_recv.calib_continuous)
+    md_recv_calibrate(true);
+  else
+    _recv.calib_running = false;
+}
 #endif
 
-#if MD_CALC_RECV_PARITY
-    parity = md_calculate_parity(&_byte_buf[2], 10);
-    if (_byte_buf[12] != parity) {
-      MD_SERIAL_PORT.print("Bad parity ");
-      MD_SERIAL_PORT.println(parity);
-      return;
-    }
+void md_recv_calibrate(bool continuous) {
+#if MD_RECV_CALIBRATE
+  // the edge ISR fills the histogram
+  noInterrupts();
+  memset(_recv.calib_hist, 0, sizeof(_recv.calib_hist));
+  _recv.calib_samples = 0;
+  _recv.calib_continuous = continuous;
+  _recv.calib_running = true;
+  interrupts();
+#else
+  (void)continuous;
+#endif
+}
+
+bool md_recv_is_calibrating() {
+#if MD_RECV_CALIBRATE
+  return _recv.calib_running;
+#else
+  return false;
 #endif
+}
 
-    // callback
-    md_packet_just_received_cb(&_byte_buf[2]);
-    // parse the packet data
-    md_packet_parse(&_byte_buf[2]);
-    _byte_idx = 0;
+void md_recv_get_thresholds(md_recv_thresholds_t *thresholds) {
+  noInterrupts();
+  *thresholds = _recv.thresholds;
+  interrupts();
+}
+
+void md_recv_set_thresholds(md_recv_thresholds_t *thresholds) {
+  noInterrupts();
+  _recv.thresholds = *thresholds;
+  interrupts();
+}
+
+// bump the counters for a frame we just dealt with
+static void _md_recv_count_frame(int8_t status, unsigned long took_us) {
+  switch (status) {
+    case MD_FRAME_OK:
+      _recv.stats.frames++;
+      break;
+    case MD_FRAME_NOP:
+      _recv.stats.nops++;
+      break;
+    case MD_FRAME_NOT_READY:
+      _recv.stats.not_ready++;
+      break;
+    case MD_FRAME_BUS_AVAIL:
+      _recv.stats.bus_avail++;
+      break;
+    case MD_FRAME_TRUNCATED:
+      _recv.stats.truncated++;
+      break;
+    case MD_FRAME_BAD_PARITY:
+      _recv.stats.parity_errors++;
+      break;
   }
+
+  uint32_t count = _recv.stats.frames + _recv.stats.nops + _recv.stats.not_ready + _recv.stats.bus_avail
+    + _recv.stats.truncated + _recv.stats.parity_errors;
+  if (count == 1 || took_us < _recv.stats.parse_us_min)
+    _recv.stats.parse_us_min = took_us;
+  if (took_us > _recv.stats.parse_us_max)
+    _recv.stats.parse_us_max = took_us;
+  _recv.parse_us_total += took_us;
+  _recv.stats.parse_us_avg = _recv.parse_us_total / count;
+
+  uint8_t bucket = 0;
+  while (bucket < MD_RECV_STATS_HIST_LEN - 1 && took_us >= (1UL << bucket))
+    bucket++;
+  _recv.stats.parse_us_hist[bucket]++;
+}
+
+// parse everything the receiver has queued up
+// @returns the status of the last frame
+static int8_t _md_recv_drain() {
+  int8_t status = MD_FRAME_NONE;
+  md_frame_t *frame;
+#if MD_RECV_CALIBRATE
+  _md_calib_update();
+#endif
+  while ((frame = _md_recv_peek_frame())) {
+    // copy it out and free the slot straight away, so a slow callback
+    // doesn't hold the ring up
+    _recv.parse_frame = *frame;
+    _md_recv_pop_frame();
+    _recv.last_frame = &_recv.parse_frame;
+    unsigned long start = micros();
+    status = _md_recv_process_frame(_recv.parse_frame.data, _recv.parse_frame.len);
+    _md_recv_count_frame(status, micros() - start);
+  }
+  return status;
+}
+
+int8_t md_recv_edge(uint8_t level, unsigned long duration) {
+  // recorded traces keep their own time
+  _recv.ended += duration;
+  if (!_md_recv_edge(level, duration))
+    return MD_FRAME_NONE;
+  return _md_recv_drain();
+}
+
+uint8_t *md_recv_get_frame(uint8_t *len) {
+  if (!_recv.last_frame) {
+    *len = 0;
+    return NULL;
+  }
+  *len = _recv.last_frame->len;
+  return _recv.last_frame->data;
+}
+
+void md_recv_get_ring_stats(md_recv_ring_stats_t *stats) {
+  noInterrupts();
+  memcpy(stats, (const void *)&_recv.ring_stats, sizeof(*stats));
+  interrupts();
+}
+
+void md_recv_get_stats(md_recv_stats_t *stats) {
+  noInterrupts();
+  memcpy(stats, (const void *)&_recv.stats, sizeof(*stats));
+  interrupts();
+}
+
+void md_recv_reset_stats() {
+  noInterrupts();
+  memset((void *)&_recv.stats, 0, sizeof(_recv.stats));
+  _recv.parse_us_total = 0;
+  _recv.wb_jitter_total = 0;
+  interrupts();
+}
+
+void md_recv_set_passive(bool is_passive) {
+  _recv.passive = is_passive;
+}
+
+void md_recv_loop()
+{
+#if !MD_RECV_USE_ISR
+  _gather_packets();
+#else
+  // the ISR only notices a dead line when the next edge finally turns up
+  noInterrupts();
+  if (micros() - _recv.started > END_MSG_TIMEOUT_US)
+    _md_recv_timeout();
+  interrupts();
+#endif
+
+  _md_recv_drain();
 }
 
 void __attribute__((weak)) md_packet_just_received_cb(uint8_t *data) {}
@@ -8,37 +8,96 @@
  */
 #include "sony_md_remote.h"
 #if MD_ENABLE_SEND
+#if MD_SEND_TIMING_EEPROM
+#include <EEPROM.h>
+#endif
+
+// this bus' sender, see md_send_t
+#define _send (_md_bus->send)
+
+// A packet compiled into the pulses to make (md_wave_step_t). Each step
+// does something to the pin and then waits us before the next one. The op
+// is packed in the top bits so a step is only 2 bytes and can be memcpy'd about.
+// Steps from the tables don't hold the us, just which of the timings it
+// is, so they follow md_send_set_timing() without being rebuilt
+
+#define MD_WAVE_HIGH      0   // drive the line high
+#define MD_WAVE_LOW       1   // drive the line low
+#define MD_WAVE_RELEASE   2   // go tri-state and let the remote drive it
+#define MD_WAVE_SAMPLE    3   // read a header bit from the remote. If set, pull low to ack it
+#define MD_WAVE_END       4
+
+#define MD_WAVE_STEP(op, us)  ((md_wave_step_t)((op) << 13 | (us)))
+#define MD_WAVE_OP(step)      ((step) >> 13)
+#define MD_WAVE_US(step)      (((step) & MD_WAVE_TIMED) ? _send.wave_us[(step) & 0xfff] : ((step) & 0xfff))
+#define MD_WAVE_US_MAX        0xfff
+
+// a step taking one of these from _send.wave_us
+#define MD_WAVE_TIMED         0x1000
+#define MD_WAVE_T_SHORT       (MD_WAVE_TIMED | 0)
+#define MD_WAVE_T_LONG        (MD_WAVE_TIMED | 1)
+#define MD_WAVE_T_ONE_HIGH    (MD_WAVE_TIMED | 2)   // the long high of a 1
+#define MD_WAVE_T_RESET_LOW   (MD_WAVE_TIMED | 3)
+#define MD_WAVE_T_RESET_HIGH  (MD_WAVE_TIMED | 4)   // and the high of the start bit
+
+#define MD_WAVE_BYTE_STEPS    16
+#define MD_WAVE_PREAMBLE_STEPS (3 + 3 * 8)
+
+// What _md_wave_compile() makes of 10 bytes. Our header keeps all its
+// steps, the data and parity lose their first into the gap before. Then END
+#define MD_WAVE_PACKET_STEPS  (MD_WAVE_PREAMBLE_STEPS + MD_WAVE_BYTE_STEPS + 1 + 11 * MD_WAVE_BYTE_STEPS + 1)
+// and _md_wave_compile_read(). A start bit and the header read for each of
+// the 11 bytes, then letting go and END
+#define MD_WAVE_READ_STEPS    (11 * (2 + MD_WAVE_PREAMBLE_STEPS - 3) + 2)
+static_assert(MD_WAVE_PACKET_STEPS <= MD_SEND_WAVE_LEN, "MD_SEND_WAVE_LEN is too short for a packet");
+static_assert(MD_WAVE_READ_STEPS <= MD_SEND_WAVE_LEN, "MD_SEND_WAVE_LEN is too short to read the remote's packet");
+
+// The pulses for every byte we could send, and for the start of every
+// packet, worked out by the compiler. 8 bits of a byte is HIGH then LOW
+// each. A 1 is a long high and short low, a 0 the other way round
+struct md_wave_tables_t {
+  md_wave_step_t bytes[256][MD_WAVE_BYTE_STEPS];
+  // reset, start bit and reading the remote's header, like md_send_read_byte()
+  md_wave_step_t preamble[MD_WAVE_PREAMBLE_STEPS];
+
+  constexpr md_wave_tables_t() : bytes(), preamble() {
+    for (int b = 0; b < 256; b++) {
+      for (int i = 0; i < 8; i++) {
+        bool one = b & 1 << i;
+        bytes[b][i * 2] = MD_WAVE_STEP(MD_WAVE_HIGH, one ? MD_WAVE_T_ONE_HIGH : MD_WAVE_T_SHORT);
+        bytes[b][i * 2 + 1] = MD_WAVE_STEP(MD_WAVE_LOW, one ? MD_WAVE_T_SHORT : MD_WAVE_T_LONG);
+      }
+    }
 
-static IntervalTimer _read_timer;
-static uint8_t _send_buffer[10];
-static uint8_t _cmd;
-static uint8_t _send_cmd;
-unsigned long lastsend;
+    preamble[0] = MD_WAVE_STEP(MD_WAVE_LOW, MD_WAVE_T_RESET_LOW);
+    // reset high and the high of the start bit run together
+    preamble[1] = MD_WAVE_STEP(MD_WAVE_HIGH, MD_WAVE_T_RESET_HIGH);
+    preamble[2] = MD_WAVE_STEP(MD_WAVE_LOW, MD_WAVE_T_LONG);
+    for (int i = 0; i < 8; i++) {
+      preamble[3 + i * 3] = MD_WAVE_STEP(MD_WAVE_HIGH, MD_WAVE_T_SHORT);
+      preamble[4 + i * 3] = MD_WAVE_STEP(MD_WAVE_RELEASE, MD_WAVE_T_LONG);
+      preamble[5 + i * 3] = MD_WAVE_STEP(MD_WAVE_SAMPLE, MD_WAVE_T_SHORT);
+    }
+  }
+};
+
+static constexpr md_wave_tables_t _wave_tables;
 
 uint8_t md_send_read_byte();
 void _set_data_available(bool is_avail);
 void _set_bus_available(bool is_avail);
 
 static void _md_send_reset() {
-  digitalWrite(MD_SEND_DATA_PIN, LOW);
-  delayMicroseconds(MD_PULSE_RESET_LOW_US);
-  digitalWrite(MD_SEND_DATA_PIN, HIGH);
-  delayMicroseconds(MD_PULSE_RESET_HIGH_US);
-}
-
-static void _md_send_one(uint8_t pin) {
-  delayMicroseconds(MD_PULSE_SHORT_US);
-  digitalWrite(pin, HIGH);
-  delayMicroseconds(MD_PULSE_LONG_US);
-  digitalWrite(pin, LOW);
-  delayMicroseconds(MD_PULSE_SHORT_US);
-  digitalWrite(pin, HIGH);
+  digitalWrite(_md_bus->send_pin, LOW);
+  delayMicroseconds(_send.timing.reset_low_us);
+  digitalWrite(_md_bus->send_pin, HIGH);
+  delayMicroseconds(_send.timing.reset_high_us);
 }
 
 static void _md_send_zero(uint8_t pin) {
-  delayMicroseconds(MD_PULSE_SHORT_US);
+  delayMicroseconds(_send.timing.pulse_short_us);
   digitalWrite(pin, LOW);
-  delayMicroseconds(MD_PULSE_LONG_US);
+  delayMicroseconds(_send.timing.pulse_long_us);
   digitalWrite(pin, HIGH);
 }
 
@@ -46,15 +105,15 @@ static uint8_t _md_send_header(bool allowed_to_read) {
   // here, we actually need to go tri-state and capture what the remote and wants
   uint8_t rw_byte = md_send_read_byte();
 
-  _send_cmd |= (1 << MD_HEADER_HOST_HOST_READY);
-  //Serial.printf("rw %d %d\n", rw_byte, _send_cmd);
+  _send.send_cmd |= (1 << MD_HEADER_HOST_HOST_READY);
+  //Serial.printf("rw %d %d\n", rw_byte, _send.send_cmd);
 
   if (allowed_to_read && (rw_byte & (1 << MD_HEADER_REMOTE_TX_READY))) {
     _set_bus_available(true);
     _set_data_available(true);
   }
 
-  md_send_byte(MD_SEND_DATA_PIN, _send_cmd);
+  md_send_byte(_md_bus->send_pin, _send.send_cmd);
 
   return rw_byte;
 }
@@ -67,24 +126,22 @@ uint8_t md_send_read_byte() {
   // go into read mode, get the value. then delay for a pulse before clocking high again
   for(int i = 0; i < 8; i++) {
     uint8_t  pinstate = 0;
-    delayMicroseconds(MD_PULSE_SHORT_US);
+    delayMicroseconds(_send.timing.pulse_short_us);
     // go to read mode
-    pinMode(MD_SEND_DATA_PIN, INPUT);
-    delayMicroseconds(20);
-
-    delayMicroseconds(MD_PULSE_LONG_US - 20);
-    pinstate = digitalRead(MD_SEND_DATA_PIN);
+    pinMode(_md_bus->send_pin, INPUT);
+    delayMicroseconds(_send.timing.pulse_long_us);
+    pinstate = digitalRead(_md_bus->send_pin);
             
     // back to output mode
     if (pinstate) {
-        pinMode(MD_SEND_DATA_PIN, OUTPUT);
-        digitalWrite(MD_SEND_DATA_PIN, LOW);
-        delayMicroseconds(MD_PULSE_SHORT_US);
-        digitalWrite(MD_SEND_DATA_PIN, HIGH);   
+        pinMode(_md_bus->send_pin, OUTPUT);
+        digitalWrite(_md_bus->send_pin, LOW);
+        delayMicroseconds(_send.timing.pulse_short_us);
+        digitalWrite(_md_bus->send_pin, HIGH);   
     } else {
-        delayMicroseconds(MD_PULSE_SHORT_US);
-        pinMode(MD_SEND_DATA_PIN, OUTPUT);
-        digitalWrite(MD_SEND_DATA_PIN, HIGH);
+        delayMicroseconds(_send.timing.pulse_short_us);
+        pinMode(_md_bus->send_pin, OUTPUT);
+        digitalWrite(_md_bus->send_pin, HIGH);
     }    
     
     data |= (pinstate << i);
@@ -94,141 +151,701 @@ uint8_t md_send_read_byte() {
 }
 
 void md_send_byte(uint8_t pin, uint8_t data_byte) {
-  for(int i = 0; i < 8; i++) {
-    if (data_byte & 1 << i)
-      _md_send_one(pin);
-    else
-      _md_send_zero(pin);
+  const md_wave_step_t *steps = _wave_tables.bytes[data_byte];
+  for(int i = 0; i < MD_WAVE_BYTE_STEPS; i++) {
+    digitalWrite(pin, MD_WAVE_OP(steps[i]) == MD_WAVE_HIGH ? HIGH : LOW);
+    delayMicroseconds(MD_WAVE_US(steps[i]));
   }
-  delayMicroseconds(MD_INTER_BYTE_DELAY);
+  digitalWrite(pin, HIGH);
+  delayMicroseconds(_send.timing.byte_gap_us);
 }
 
-void md_send_data(uint8_t pin, uint8_t *data, uint8_t len, uint8_t wait_pulse) {
+bool md_send_data(uint8_t pin, uint8_t *data, uint8_t len, uint8_t wait_pulse) {
   for(int i = 0; i < len; i++) {
     if (wait_pulse) {
-      _poll_pin_change(LOW);
-      _poll_pin_change(HIGH);
+      // the host went away
+      if (!_poll_pin_change(LOW) || !_poll_pin_change(HIGH))
+        return false;
     }
     md_send_byte(pin, data[i]);
-    delayMicroseconds(MD_INTER_BYTE_DELAY);
+    // md_send_byte() has already waited byte_gap_us of it
+    if (_send.timing.data_gap_us > _send.timing.byte_gap_us)
+      delayMicroseconds(_send.timing.data_gap_us - _send.timing.byte_gap_us);
   }
   md_send_byte(pin, md_calculate_parity(data, len));
+  return true;
+}
+
+static uint16_t _md_wave_clamp(uint32_t us) {
+  return us > MD_WAVE_US_MAX ? MD_WAVE_US_MAX : us;
+}
+
+// add a step, or stretch the last one if it leaves the line the same way.
+// @returns false if there's no room, and the wave is no good
+static bool _md_wave_add(uint8_t op, uint16_t us) {
+  if (_send.wave_len) {
+    md_wave_step_t *last = &_send.wave[_send.wave_len - 1];
+    if (MD_WAVE_OP(*last) == op && (op == MD_WAVE_HIGH || op == MD_WAVE_LOW)) {
+      *last = MD_WAVE_STEP(op, _md_wave_clamp(MD_WAVE_US(*last) + us));
+      return true;
+    }
+  }
+  if (_send.wave_len >= MD_SEND_WAVE_LEN)
+    return false;
+  _send.wave[_send.wave_len++] = MD_WAVE_STEP(op, _md_wave_clamp(us));
+  return true;
+}
+
+// copy in steps from the tables. The first one is folded into the one
+// before if it carries on the same level, i.e. the gap after a byte.
+// @returns false if they don't all fit, and the wave is no good
+static bool _md_wave_copy(const md_wave_step_t *steps, uint8_t count) {
+  if (_send.wave_len + count > MD_SEND_WAVE_LEN)
+    return false;
+  if (_send.wave_len && MD_WAVE_OP(_send.wave[_send.wave_len - 1]) == MD_WAVE_OP(steps[0]) &&
+      MD_WAVE_OP(steps[0]) <= MD_WAVE_LOW) {
+    md_wave_step_t *last = &_send.wave[_send.wave_len - 1];
+    *last = MD_WAVE_STEP(MD_WAVE_OP(*last), _md_wave_clamp(MD_WAVE_US(*last) + MD_WAVE_US(steps[0])));
+    steps++;
+    count--;
+  }
+  memcpy(&_send.wave[_send.wave_len], steps, count * sizeof(md_wave_step_t));
+  _send.wave_len += count;
+  return true;
+}
+
+static bool _md_wave_add_byte(uint8_t data_byte, uint16_t gap_us) {
+  return _md_wave_copy(_wave_tables.bytes[data_byte], MD_WAVE_BYTE_STEPS) &&
+    _md_wave_add(MD_WAVE_HIGH, gap_us);
+}
+
+// Turn a whole packet into pulses, just like md_send_packet() used to send
+// them: reset, start bit, read the remote's header, our header, the data, parity.
+// @returns false if it didn't fit, which takes more than 10 bytes
+static bool _md_wave_compile(uint8_t *data, uint8_t len) {
+  _send.wave_len = 0;
+  _send.wave_is_read = false;
+  bool ok = _md_wave_copy(_wave_tables.preamble, MD_WAVE_PREAMBLE_STEPS) &&
+    _md_wave_add_byte(_send.send_cmd, _send.timing.byte_gap_us);
+  for(int i = 0; ok && i < len; i++)
+    ok = _md_wave_add_byte(data[i], _send.timing.data_gap_us);
+  return ok && _md_wave_add_byte(md_calculate_parity(data, len), _send.timing.byte_gap_us) &&
+    _md_wave_add(MD_WAVE_END, 0);
+}
+
+// Reading a packet from the remote once it has the bus. For each of the 10
+// bytes and parity, a zero start bit then clock the byte in like the header.
+// Always the same length, and MD_WAVE_READ_STEPS says it fits
+static void _md_wave_compile_read() {
+  _send.wave_len = 0;
+  _send.wave_is_read = true;
+  for (int i = 0; i < 11; i++) {
+    _md_wave_add(MD_WAVE_HIGH, _send.timing.pulse_long_us + _send.timing.pulse_short_us);
+    _md_wave_add(MD_WAVE_LOW, _send.timing.pulse_long_us);
+    // the header read part of the preamble
+    _md_wave_copy(_wave_tables.preamble + 3, MD_WAVE_PREAMBLE_STEPS - 3);
+  }
+  // hold it up after the last bit like after a packet, or the remote sees
+  // no end to it, and a reset straight after looks too long
+  _md_wave_add(MD_WAVE_HIGH, _send.timing.byte_gap_us);
+  _md_wave_add(MD_WAVE_END, 0);
+}
+
+// do what a step says to the pin
+static void _md_wave_apply(uint8_t op) {
+  switch (op) {
+    case MD_WAVE_HIGH:
+    case MD_WAVE_LOW:
+      if (_send.wave_released) {
+        pinMode(_md_bus->send_pin, OUTPUT);
+        _send.wave_released = false;
+      }
+      digitalWrite(_md_bus->send_pin, op == MD_WAVE_HIGH ? HIGH : LOW);
+      break;
+    case MD_WAVE_RELEASE:
+      pinMode(_md_bus->send_pin, INPUT);
+      _send.wave_released = true;
+      break;
+    case MD_WAVE_SAMPLE: {
+      uint8_t bit = digitalRead(_md_bus->send_pin);
+      _send.wave_read[_send.wave_read_bit >> 3] |= bit << (_send.wave_read_bit & 7);
+      _send.wave_read_bit++;
+      if (bit) {
+        pinMode(_md_bus->send_pin, OUTPUT);
+        digitalWrite(_md_bus->send_pin, LOW);
+        _send.wave_released = false;
+      }
+      break;
+    }
+  }
+}
+
+static void _md_wave_start() {
+  _send.wave_idx = 0;
+  memset(_send.wave_read, 0, sizeof(_send.wave_read));
+  _send.wave_read_bit = 0;
+  _send.wave_released = false;
+}
+
+static void _md_send_adapt(uint8_t header, unsigned long now);
+
+// the packet has gone, the remote's header is in _send.wave_read. Never
+// from the timer interrupt, the adapting and the callback aren't safe there
+static void _md_wave_done() {
+  if (_send.wave_is_read) {
+    memcpy(_send.read_buffer, _send.wave_read, sizeof(_send.read_buffer));
+    _send.read_parity_ok = md_calculate_parity(_send.read_buffer, sizeof(_send.read_buffer)) == _send.wave_read[10];
+    _send.read_ready = true;
+    return;
+  }
+  _send.cmd = _send.wave_read[0];
+  _md_send_adapt(_send.cmd, _send.last_send);
+  md_send_done_cb(_send.cmd);
+}
+
+#if MD_SEND_ASYNC
+// One step per tick. The timer reloads as it fires, so the length set
+// here is for the step after this one
+static void _md_wave_tick() {
+  uint16_t idx = ++_send.wave_idx;
+  uint8_t op = MD_WAVE_OP(_send.wave[idx]);
+  if (op == MD_WAVE_END) {
+    _send.wave_timer.end();
+    // md_send_loop() takes it from here
+    _send.last_send = micros();
+    _send.wave_finished = true;
+    _send.wave_busy = false;
+    return;
+  }
+  _md_wave_apply(op);
+  _send.wave_timer.update(MD_WAVE_US(_send.wave[idx + 1]) ? MD_WAVE_US(_send.wave[idx + 1]) : 1);
+}
+MD_BUS_TRAMPOLINES(_md_wave_tick);
+
+static void _md_wave_play() {
+  _md_wave_start();
+  _send.wave_busy = true;
+  _md_wave_apply(MD_WAVE_OP(_send.wave[0]));
+  _send.wave_timer.begin(_md_wave_tick_trampolines[_md_bus->id], MD_WAVE_US(_send.wave[0]));
+  _send.wave_timer.update(MD_WAVE_US(_send.wave[1]) ? MD_WAVE_US(_send.wave[1]) : 1);
+}
+#else
+static void _md_wave_play() {
+  _md_wave_start();
+  for (uint16_t i = 0; MD_WAVE_OP(_send.wave[i]) != MD_WAVE_END; i++) {
+    _md_wave_apply(MD_WAVE_OP(_send.wave[i]));
+    delayMicroseconds(MD_WAVE_US(_send.wave[i]));
+  }
+  _send.last_send = micros();
+  _md_wave_done();
+}
+#endif
+
+bool md_send_is_busy() {
+#if MD_SEND_ASYNC
+  return _send.wave_busy;
+#else
+  return false;
+#endif
+}
+
+// finish off a packet the timer has finished playing
+static void _md_wave_collect() {
+#if MD_SEND_ASYNC
+  if (!_send.wave_finished)
+    return;
+  _send.wave_finished = false;
+  _md_wave_done();
+#endif
+}
+
+// let the packet that is going out finish
+static void _md_send_wait() {
+  while (md_send_is_busy())
+    yield();
+  _md_wave_collect();
 }
 
 void _set_data_available(bool is_avail) {
   // it's inverted
   if (is_avail)
-    _send_cmd &= ~(1 << MD_HEADER_HOST_DATA_AVAIL);
+    _send.send_cmd &= ~(1 << MD_HEADER_HOST_DATA_AVAIL);
   else
-    _send_cmd |= (1 << MD_HEADER_HOST_DATA_AVAIL);
+    _send.send_cmd |= (1 << MD_HEADER_HOST_DATA_AVAIL);
 }
 
 
 void _set_bus_available(bool is_avail) {
   if (is_avail)
-    _send_cmd |= (1 << MD_HEADER_HOST_BUS_AVAIL);
+    _send.send_cmd |= (1 << MD_HEADER_HOST_BUS_AVAIL);
   else
-    _send_cmd &= ~(1 << MD_HEADER_HOST_BUS_AVAIL);    
+    _send.send_cmd &= ~(1 << MD_HEADER_HOST_BUS_AVAIL);    
 }
 
+// With MD_SEND_ASYNC this only waits for the previous packet, and returns
+// the header from that one. md_send_done_cb() gets the header for this one
 uint8_t md_send_packet(uint8_t *data, uint8_t len) {
-  _md_send_reset();
-  _md_send_zero(MD_SEND_DATA_PIN);
+  _md_send_wait();
   _set_data_available(true);
   _set_bus_available(false);
-  uint8_t cmd = _md_send_header(false);
+  // we don't hand the bus over, so the header doesn't depend on what the remote says
+  _send.send_cmd |= (1 << MD_HEADER_HOST_HOST_READY);
 
   // could add a callback here to allow the host app to determine payload if it wants to
   // for now, the cmd is returned. let the sender deal with cmd modes
-  md_send_data(MD_SEND_DATA_PIN, data, len, 0);  
+  if (!_md_wave_compile(data, len)) {
+    // nothing goes rather than half of it
+    MD_LOG(MD_LOG_ERROR, MD_LOG_TAG_SEND_WAVE, data, len);
+    return _send.cmd;
+  }
+  _md_wave_play();
+
+#if MD_LOG_LEVEL >= MD_LOG_DEBUG
+  // with MD_SEND_ASYNC that's the header from the one before
+  uint8_t rec[MD_RECV_FRAME_LEN];
+  if (len > sizeof(rec) - 1)
+    len = sizeof(rec) - 1;
+  memcpy(rec, data, len);
+  rec[len] = _send.cmd;
+  MD_LOG(MD_LOG_DEBUG, MD_LOG_TAG_SEND_FRAME, rec, len + 1);
+#endif
+  return _send.cmd;
+}
+
+void md_send_set_timing(const md_send_timing_t *timing) {
+  _md_send_wait();
+  _send.timing = *timing;
+  _send.wave_us[MD_WAVE_T_SHORT & ~MD_WAVE_TIMED] = _send.timing.pulse_short_us;
+  _send.wave_us[MD_WAVE_T_LONG & ~MD_WAVE_TIMED] = _send.timing.pulse_long_us;
+  _send.wave_us[MD_WAVE_T_ONE_HIGH & ~MD_WAVE_TIMED] = _send.timing.pulse_short_us + _send.timing.pulse_long_us;
+  _send.wave_us[MD_WAVE_T_RESET_LOW & ~MD_WAVE_TIMED] = _send.timing.reset_low_us;
+  _send.wave_us[MD_WAVE_T_RESET_HIGH & ~MD_WAVE_TIMED] = _send.timing.reset_high_us + _send.timing.pulse_short_us;
+}
 
-  //// dont set it for now
-  _cmd = cmd;
-  Serial.println(_cmd);
-  lastsend = micros();
-  return cmd;
+void md_send_get_timing(md_send_timing_t *timing) {
+  *timing = _send.timing;
+}
+
+#if MD_SEND_TIMING_EEPROM
+// what lives in the EEPROM
+typedef struct md_send_timing_store_t {
+  uint16_t magic;
+  md_send_timing_t timing;
+  uint8_t parity;
+} md_send_timing_store_t;
+
+#define MD_SEND_TIMING_MAGIC  0x4D54
+
+void md_send_save_timing() {
+  md_send_timing_store_t store;
+  store.magic = MD_SEND_TIMING_MAGIC;
+  store.timing = _send.timing;
+  store.parity = md_calculate_parity((uint8_t *)&store.timing, sizeof(store.timing));
+  EEPROM.put(MD_SEND_TIMING_EEPROM_ADDR, store);
+}
+
+bool md_send_load_timing() {
+  md_send_timing_store_t store;
+  EEPROM.get(MD_SEND_TIMING_EEPROM_ADDR, store);
+  if (store.magic != MD_SEND_TIMING_MAGIC ||
+      store.parity != md_calculate_parity((uint8_t *)&store.timing, sizeof(store.timing)))
+    return false;
+  md_send_set_timing(&store.timing);
+  return true;
+}
+#endif
+
+// header from a remote that is happy with what we sent it. A line
+// nobody is driving reads all 1s
+static bool _md_send_header_ok(uint8_t header) {
+  return header != 0xFF && (header & (1 << MD_HEADER_REMOTE_IS_INIT)) &&
+    !(header & (1 << MD_HEADER_REMOTE_ERROR));
+}
+
+// Ask for capabilities block 1 and read the answer back. That takes in
+// every pulse, gap and reset we make, both ways
+static bool _md_send_probe() {
+  uint8_t buf[10] = { CMD_CAPABILITIES };
+  uint8_t header;
+
+  buf[REG_CAPABILITIES_BLOCK] = 1;
+
+  md_send_packet(buf, sizeof(buf));
+  _md_send_wait();
+  if (!_md_send_header_ok(_send.cmd))
+    return false;
+  delayMicroseconds(MD_SEND_POLL_MIN_US);
+
+  for (int i = 0; i < MD_SEND_CALIB_POLLS; i++) {
+    _md_send_reset();
+    _md_send_zero(_md_bus->send_pin);
+    _set_bus_available(false);
+    _set_data_available(false);
+    header = _md_send_header(true);
+    if (!_md_send_header_ok(header))
+      return false;
+    if (header & (1 << MD_HEADER_REMOTE_TX_READY)) {
+      bool ok = md_send_read_packet(buf);
+      _set_bus_available(true);
+      // its answers all start 0xC0
+      return ok && buf[0] == 0xC0;
+    }
+    delayMicroseconds(MD_SEND_POLL_MIN_US);
+  }
+  // it never answered
+  return false;
+}
+
+static bool _md_send_probe_timing(const md_send_timing_t *timing) {
+  md_send_set_timing(timing);
+  for (int i = 0; i < MD_SEND_CALIB_PROBES; i++) {
+    if (!_md_send_probe())
+      return false;
+  }
+  return true;
+}
+
+// Find the shortest each timing can be and still get clean answers from
+// the remote, one at a time, by bisecting between 0 and what works now.
+// What it ends up with has 1/8th added back on for luck, up to what it was
+bool md_send_calibrate(bool save) {
+  const md_send_timing_t before = _send.timing;
+  md_send_timing_t best = before;
+  uint16_t md_send_timing_t::*fields[] = {
+    &md_send_timing_t::pulse_short_us, &md_send_timing_t::pulse_long_us,
+    &md_send_timing_t::reset_low_us, &md_send_timing_t::reset_high_us,
+    &md_send_timing_t::byte_gap_us, &md_send_timing_t::data_gap_us,
+  };
+
+  // no point going on if the remote doesn't like what we have now
+  if (!_md_send_probe_timing(&best)) {
+    md_send_set_timing(&before);
+    return false;
+  }
+
+  for (uint8_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+    uint16_t good = best.*fields[f];
+    uint16_t bad = 0;
+
+    while (good - bad > MD_SEND_CALIB_STEP_US) {
+      md_send_timing_t trial = best;
+      trial.*fields[f] = bad + (good - bad) / 2;
+      if (_md_send_probe_timing(&trial)) {
+        good = trial.*fields[f];
+      } else {
+        bad = trial.*fields[f];
+        // let it get over whatever we just sent it
+        md_send_set_timing(&best);
+        delayMicroseconds(MD_SEND_POLL_MAX_US);
+        _md_send_probe();
+      }
+    }
+    // but no more than it was. The long pulse is also how long we wait for
+    // the remote's bits, and they don't last much past it
+    best.*fields[f] = good + good / 8 < before.*fields[f] ? good + good / 8 : before.*fields[f];
+  }
+
+  // check it all still works together
+  if (!_md_send_probe_timing(&best)) {
+    md_send_set_timing(&before);
+    return false;
+  }
+#if MD_SEND_TIMING_EEPROM
+  if (save)
+    md_send_save_timing();
+#else
+  (void)save;
+#endif
+  return true;
 }
 
 void md_send_setup() {
-  pinMode(MD_SEND_DATA_PIN, OUTPUT);
+  md_send_set_timing(&_send.timing);
+#if MD_SEND_TIMING_EEPROM
+  // a profile from md_send_calibrate() if there is one
+  md_send_load_timing();
+#endif
+  pinMode(_md_bus->send_pin, OUTPUT);
   // start with the data pin active high
-  digitalWrite(MD_SEND_DATA_PIN, HIGH);
+  digitalWrite(_md_bus->send_pin, HIGH);
   // wait for the line to settle
   delayMicroseconds(8000);
+  md_send_reset_poll_stats();
 }
 
-bool _read_packet() {
-  //delayMicroseconds(10);
-  // read 10 bytes + parity
-  for(int i = 0; i < 10; i++) {
-    delayMicroseconds(MD_PULSE_LONG_US);
-    _md_send_zero(MD_SEND_DATA_PIN);
-
-    uint8_t a = md_send_read_byte();
-    _send_buffer[i] = a;
-    Serial.printf("%02x", a);
-    Serial.print(" ");
-  }
-  delayMicroseconds(MD_PULSE_LONG_US);
-  _md_send_zero(MD_SEND_DATA_PIN);
-  
-  Serial.println(md_calculate_parity(_send_buffer, 10));
-  bool done = md_calculate_parity(_send_buffer, 10) == md_send_read_byte();
+// start reading the remote's packet. With MD_SEND_ASYNC this returns
+// straight away and md_send_loop() hands it over when it's done
+static void _md_send_read_start() {
+  _send.read_ready = false;
+  _md_wave_compile_read();
+  _md_wave_play();
+}
 
+bool md_send_read_packet(uint8_t *buf) {
+  _md_send_wait();
+  _md_send_read_start();
+  _md_send_wait();
+  _send.read_ready = false;
+  memcpy(buf, _send.read_buffer, sizeof(_send.read_buffer));
+  return _send.read_parity_ok;
 }
 
 // do a NOP right now, unless we have some data to recieve, in which case read it in
 void _do_send_recv() {
-  lastsend = micros();
+  _md_send_wait();
+  _send.last_send = micros();
   _md_send_reset();
-  _md_send_zero(MD_SEND_DATA_PIN);
+  _md_send_zero(_md_bus->send_pin);
   _set_bus_available(false);
   _set_data_available(false);
-  _cmd = _md_send_header(true);
-  //Serial.println(_cmd);
-  if (_cmd & (1 << MD_HEADER_REMOTE_TX_READY)) {
-    Serial.println("S:RECV");
+  _send.cmd = _md_send_header(true);
+  _send.poll_stats.polls++;
+  _md_send_adapt(_send.cmd, _send.last_send);
+  if (_send.cmd & (1 << MD_HEADER_REMOTE_TX_READY)) {
     // read in the data
-    _read_packet();
+    _md_send_read_start();
     _set_bus_available(true);
   }
 }
 
+// give the app what the remote sent, now we are clear of the bus timing
+static void _md_send_deliver_read() {
+  if (!_send.read_ready)
+    return;
+  _send.read_ready = false;
+
+  _send.poll_stats.reads++;
+  if (!_send.read_parity_ok)
+    _send.poll_stats.read_parity_errors++;
+
+#if MD_LOG_LEVEL >= MD_LOG_DEBUG
+  uint8_t rec[sizeof(_send.read_buffer) + 1];
+  memcpy(rec, _send.read_buffer, sizeof(_send.read_buffer));
+  rec[sizeof(_send.read_buffer)] = _send.read_parity_ok;
+  MD_LOG(MD_LOG_DEBUG, MD_LOG_TAG_REMOTE_FRAME, rec, sizeof(rec));
+#endif
+  md_send_remote_packet_cb(_send.read_buffer, sizeof(_send.read_buffer), _send.read_parity_ok);
+#if MD_ENABLE_PROXY && MD_ENABLE_RECV
+  if (_md_bus->proxy)
+    _md_proxy_from_remote(_send.read_buffer, sizeof(_send.read_buffer), _send.read_parity_ok);
+#endif
+}
+
+static uint8_t _md_send_prio(uint8_t cmd) {
+  switch (cmd) {
+    case CMD_TEXT:
+    case CMD_CAPABILITIES:
+      return MD_SEND_PRIO_HIGH;
+    case CMD_TRACK:
+    case CMD_PLAY_STATE:
+    case CMD_VOLUME:
+    case CMD_PLAY_MODE:
+    case CMD_DISP_MODE_MAYBE:
+      return MD_SEND_PRIO_NORMAL;
+    default:
+      return MD_SEND_PRIO_LOW;
+  }
+}
+
+// text chunks all need to go, in order. Capabilities are one block each
+static bool _md_send_coalesces(uint8_t cmd) {
+  return cmd != CMD_TEXT && cmd != CMD_CAPABILITIES;
+}
+
+bool md_send_queue(uint8_t *data, uint8_t len) {
+  if (len > sizeof(_send.queue[0].data))
+    len = sizeof(_send.queue[0].data);
+
+  uint8_t prio = _md_send_prio(data[0]);
+  int free_slot = -1;
+  int victim = -1;
+  uint8_t depth = 0;
+
+  for (int i = 0; i < MD_SEND_QUEUE_LEN; i++) {
+    md_send_slot_t *slot = &_send.queue[i];
+    if (!slot->used) {
+      if (free_slot < 0)
+        free_slot = i;
+      continue;
+    }
+    depth++;
+
+    // newer state for the same thing. It keeps its place
+    if (slot->data[0] == data[0] && _md_send_coalesces(data[0])) {
+      memcpy(slot->data, data, len);
+      slot->len = len;
+      _send.queue_stats.coalesced++;
+      return true;
+    }
+
+    // if it comes to it, throw out the newest of the least important
+    if (slot->prio < prio && (victim < 0 || slot->prio < _send.queue[victim].prio ||
+        (slot->prio == _send.queue[victim].prio && slot->seq > _send.queue[victim].seq)))
+      victim = i;
+  }
+
+  if (free_slot < 0) {
+    _send.queue_stats.dropped++;
+    if (victim < 0)
+      return false;
+    free_slot = victim;
+    depth--;
+  }
+
+  md_send_slot_t *slot = &_send.queue[free_slot];
+  memcpy(slot->data, data, len);
+  slot->len = len;
+  slot->prio = prio;
+  slot->seq = _send.queue_seq++;
+  slot->used = true;
+
+  _send.queue_stats.queued++;
+  if (depth + 1 > _send.queue_stats.max_depth)
+    _send.queue_stats.max_depth = depth + 1;
+  return true;
+}
+
+bool md_send_is_queued(uint8_t cmd) {
+  for (int i = 0; i < MD_SEND_QUEUE_LEN; i++)
+    if (_send.queue[i].used && _send.queue[i].data[0] == cmd)
+      return true;
+  return false;
+}
+
+uint8_t md_send_queue_space() {
+  uint8_t space = 0;
+  for (int i = 0; i < MD_SEND_QUEUE_LEN; i++)
+    if (!_send.queue[i].used)
+      space++;
+  return space;
+}
+
+void md_send_get_queue_stats(md_send_queue_stats_t *stats) {
+  *stats = _send.queue_stats;
+}
+
+// @returns the slot that should go next, or -1 if it's empty
+static int _md_send_queue_next() {
+  int next = -1;
+  for (int i = 0; i < MD_SEND_QUEUE_LEN; i++) {
+    if (!_send.queue[i].used)
+      continue;
+    if (next < 0 || _send.queue[i].prio > _send.queue[next].prio ||
+        (_send.queue[i].prio == _send.queue[next].prio && _send.queue[i].seq < _send.queue[next].seq))
+      next = i;
+  }
+  return next;
+}
+
+// Every header from the remote says whether it's busy. Poll quickly while
+// it is, back off while it isn't
+static void _md_send_adapt(uint8_t header, unsigned long now) {
+  bool wants_bus = header & (1 << MD_HEADER_REMOTE_TX_READY);
+
+  if (wants_bus || (header & (1 << MD_HEADER_REMOTE_READY_FOR_TEXT))) {
+    _send.poll_us = MD_SEND_POLL_MIN_US;
+  } else {
+    _send.poll_us *= 2;
+    if (_send.poll_us > MD_SEND_POLL_MAX_US)
+      _send.poll_us = MD_SEND_POLL_MAX_US;
+  }
+
+  if (!wants_bus) {
+    _send.poll_quiet_since = now;
+    _send.poll_remote_waiting = false;
+    return;
+  }
+  // only the first header it asks in counts
+  if (_send.poll_remote_waiting)
+    return;
+  _send.poll_remote_waiting = true;
+
+  uint32_t latency = now - _send.poll_quiet_since;
+  _send.poll_stats.remote_waits++;
+  if (_send.poll_stats.remote_waits == 1 || latency < _send.poll_stats.latency_us_min)
+    _send.poll_stats.latency_us_min = latency;
+  if (latency > _send.poll_stats.latency_us_max)
+    _send.poll_stats.latency_us_max = latency;
+  _send.poll_latency_total += latency;
+  _send.poll_stats.latency_us_avg = _send.poll_latency_total / _send.poll_stats.remote_waits;
+}
+
+void md_send_get_poll_stats(md_send_poll_stats_t *stats) {
+  unsigned long elapsed = micros() - _send.poll_stats_start;
+  *stats = _send.poll_stats;
+  stats->interval_us = _send.poll_us;
+  if (elapsed)
+    stats->polls_per_sec = (uint64_t)_send.poll_stats.polls * 1000000 / elapsed;
+}
+
+void md_send_reset_poll_stats() {
+  memset(&_send.poll_stats, 0, sizeof(_send.poll_stats));
+  _send.poll_latency_total = 0;
+  _send.poll_stats_start = micros();
+}
+
 // call me periodically!
 void md_send_loop() {
   unsigned long tnow = micros();
-  bool send_now = false;//_cmd & (1 << MD_HEADER_REMOTE_TX_READY);
+  bool send_now = false;//_send.cmd & (1 << MD_HEADER_REMOTE_TX_READY);
   
-  // if time has elapsed, send a nop
-  if (send_now || tnow - lastsend > 32000) {      
+  // still sending, that keeps the remote awake just as well
+  if (md_send_is_busy())
+    return;
+
+  _md_wave_collect();
+  _md_send_deliver_read();
+
+  unsigned long since = tnow - _send.last_send;
+  bool remote_wants_bus = _send.cmd & (1 << MD_HEADER_REMOTE_TX_READY);
+
+  // a slot is free. The remote gets it if it has something to say,
+  // otherwise send whatever is waiting
+  if (since > MD_SEND_SLOT_US && !remote_wants_bus) {
+    int next = _md_send_queue_next();
+    if (next >= 0) {
+      md_send_packet(_send.queue[next].data, _send.queue[next].len);
+      _send.queue[next].used = false;
+      _send.queue_stats.sent++;
+      // the state it came from is up to date on the remote now
+      _md_cmd_sent(_send.queue[next].data);
+      return;
+    }
+  }
+
+  // if time has elapsed, send a nop. Sooner if the remote is busy
+  if (send_now || since > _send.poll_us) {
     _do_send_recv();
   }
 }
 
 // get the tx buffer so the app can send some stuff
 uint8_t *md_get_send_buf() {
-  memset(_send_buffer, 0, 10);
-  return _send_buffer;
+  memset(_send.send_buffer, 0, 10);
+  return _send.send_buffer;
 }
 
 // check to see if we are ready for text
 bool md_send_is_ready_for_text() {
-  uint8_t a = (_cmd & 1 << MD_HEADER_REMOTE_READY_FOR_TEXT);
-  _cmd &= ~(1 << MD_HEADER_REMOTE_READY_FOR_TEXT);
+  uint8_t a = (_send.cmd & 1 << MD_HEADER_REMOTE_READY_FOR_TEXT);
+  _send.cmd &= ~(1 << MD_HEADER_REMOTE_READY_FOR_TEXT);
   return a;
 }
 
 bool md_send_is_ready_for_timer() {
-  uint8_t a = (_cmd & 1 << MD_HEADER_REMOTE_TIMER);
-  _cmd &= ~(1 << MD_HEADER_REMOTE_TIMER);
+  uint8_t a = (_send.cmd & 1 << MD_HEADER_REMOTE_TIMER);
+  _send.cmd &= ~(1 << MD_HEADER_REMOTE_TIMER);
   return a;
 }
 
 bool md_send_is_error() {
-  return (_cmd & (1 << MD_HEADER_REMOTE_ERROR));
+  return (_send.cmd & (1 << MD_HEADER_REMOTE_ERROR));
 }
 
 uint8_t md_send_get_cmd() {
-  return _cmd;
+  return _send.cmd;
 }
+
+void __attribute__((weak)) md_send_done_cb(uint8_t) {}
+void __attribute__((weak)) md_send_remote_packet_cb(uint8_t *, uint8_t, bool) {}
 #endif
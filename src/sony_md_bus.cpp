@@ -0,0 +1,55 @@
+/*
+ * Sony MD Remote bus context
+ * Barry Carter 2022 <barry.carter@gmail.com>
+ *
+ * Keeps track of the buses, and which one the md_* calls are working on.
+ *
+ * Example, two players on one board:
+ *
+ * md_bus_t bus2;
+ *
+ * void setup() {
+ *   md_setup();
+ *   md_bus_init(&bus2, 5, 6);
+ *   md_bus_select(&bus2);
+ *   md_setup();
+ * }
+ *
+ * void loop() {
+ *   md_bus_select(&md_bus_default);
+ *   md_loop();
+ *   md_bus_select(&bus2);
+ *   md_loop();
+ * }
+ */
+#include "sony_md_remote.h"
+
+md_bus_t md_bus_default;
+MD_BUS_TLS md_bus_t *_md_bus = &md_bus_default;
+
+static md_bus_t *_buses[MD_BUS_MAX] = { &md_bus_default };
+
+bool md_bus_init(md_bus_t *bus, uint8_t data_pin, uint8_t send_pin) {
+  for (uint8_t i = 1; i < MD_BUS_MAX; i++) {
+    if (_buses[i] && _buses[i] != bus)
+      continue;
+    bus->id = i;
+    bus->data_pin = data_pin;
+    bus->send_pin = send_pin;
+    _buses[i] = bus;
+    return true;
+  }
+  return false;
+}
+
+void md_bus_select(md_bus_t *bus) {
+  _md_bus = bus;
+}
+
+md_bus_t *md_bus_current() {
+  return _md_bus;
+}
+
+md_bus_t *md_bus_get(uint8_t id) {
+  return id < MD_BUS_MAX ? _buses[id] : NULL;
+}
@@ -0,0 +1,269 @@
+/*
+ * Sony MD Remote bus context
+ * Barry Carter 2022 <barry.carter@gmail.com>
+ *
+ * Everything the receiver, sender and state handler keep for one bus,
+ * so one board can talk to more than one player/remote. The md_* calls
+ * all work on the current bus, pick it with md_bus_select().
+ *
+ * Included from sony_md_remote.h, don't include it on its own.
+ */
+#pragma once
+
+// most buses one board can run. Each gets its own interrupt trampolines
+#ifndef MD_BUS_MAX
+#define MD_BUS_MAX  4
+#endif
+
+// Storage for the current bus pointer. Set it to thread_local when more
+// than one thread runs the library at once (only on the host)
+#ifndef MD_BUS_TLS
+#define MD_BUS_TLS
+#endif
+
+// A packet compiled into the pulses to make, see protocol_sender.cpp
+typedef uint16_t md_wave_step_t;
+
+// a frame waiting in the transmit queue
+typedef struct md_send_slot_t {
+  bool used;
+  uint8_t prio;
+  uint8_t len;
+  uint32_t seq;                   // when it was queued, for keeping the order
+  uint8_t data[10];
+} md_send_slot_t;
+
+// Text is kept in pages of one packet's worth (7 chars), in a ring. Pages
+// that have been sent, or read by the app, go back to the ring, so text can
+// stream through that is longer than the ring
+typedef struct md_text_store_t {
+  char buf[MD_TEXT_POOL_PAGES * REG_TEXT_LEN + 1];
+  uint8_t head;                   // page with the oldest text
+  uint8_t pages;                  // pages in use
+  uint8_t tail_len;               // chars in the newest page
+  uint8_t done;                   // pages already sent/read, can be reused
+  bool closed;                    // nothing more is coming
+  bool read;                      // some of it went to md_text_read() already
+  bool truncated;                 // there was more than the ring could hold
+} md_text_store_t;
+
+// Titles we have already had from the player, by track, so going back to
+// one doesn't have to wait for it all to come over the bus again
+typedef struct md_title_cache_t {
+  bool used;
+  uint8_t track;
+  uint32_t last_used;
+  char title[MD_TITLE_CACHE_LEN];
+} md_title_cache_t;
+
+// someone wanting to hear about changes, see md_event_subscribe()
+typedef struct md_event_listener_t {
+  md_event_cb_t cb;
+  uint16_t mask;
+  void *ctx;
+} md_event_listener_t;
+
+// protocol_decoder.cpp
+typedef struct md_recv_t {
+  uint8_t prev_level;
+  uint8_t state;
+  unsigned long started;
+  unsigned long pulse_duration;
+  unsigned long ended;
+  uint8_t byte_buf[MD_RECV_FRAME_LEN];
+  uint8_t byte_idx;
+  uint8_t bit_counter;
+  uint8_t tmp_data;
+  // edges left to skip before the header starts (the start bit)
+  uint8_t skip_edges;
+  // health counters
+  volatile md_recv_stats_t stats;
+  uint64_t parse_us_total;
+  int64_t wb_jitter_total;
+#if MD_RECV_WB_TIMER
+  // one shot to end a header write back
+  IntervalTimer wb_timer;
+  volatile bool wb_active;
+  volatile unsigned long wb_started;
+#endif
+  // Finished frames waiting for md_recv_loop() to parse them.
+  // Single producer (the decoder, maybe in the ISR) and single consumer
+  // (md_recv_loop), so the head and tail need no locking. Only the producer
+  // moves the head, only the consumer moves the tail.
+  md_frame_t frame_ring[MD_RECV_RING_LEN];
+  volatile uint8_t frame_head;
+  volatile uint8_t frame_tail;
+  volatile md_recv_ring_stats_t ring_stats;
+  // the frame md_recv_loop() is parsing, or last parsed
+  md_frame_t parse_frame;
+  md_frame_t *last_frame;
+  // just listen, don't talk back
+  bool passive;
+  // which byte of send_buf the host is reading, send_len is the parity
+  uint8_t tx_idx;
+  // the thresholds the decoder is using right now
+  md_recv_thresholds_t thresholds = {
+    PULSE_WIDTH_ON_US_MIN, RESET_LOW_US_MIN, RESET_LOW_US_MAX, 0, 0
+  };
+#if MD_RECV_CALIBRATE
+  uint16_t calib_hist[MD_RECV_CALIB_BUCKETS];
+  volatile uint32_t calib_samples;
+  volatile bool calib_running;
+  bool calib_continuous;
+#endif
+  uint8_t send_byte;
+  uint8_t send_buf[10];
+  uint8_t send_len;
+} md_recv_t;
+
+// protocol_sender.cpp
+typedef struct md_send_t {
+  uint8_t send_buffer[10];
+  uint8_t cmd;
+  uint8_t send_cmd;
+  volatile unsigned long last_send;
+  md_send_timing_t timing = {
+    MD_PULSE_SHORT_US, MD_PULSE_LONG_US, MD_PULSE_RESET_LOW_US, (MD_PULSE_RESET_HIGH_US),
+    MD_INTER_BYTE_DELAY, 2 * MD_INTER_BYTE_DELAY
+  };
+  // what each of the MD_WAVE_T_* steps lasts with that timing
+  uint16_t wave_us[5] = {
+    MD_PULSE_SHORT_US, MD_PULSE_LONG_US, MD_PULSE_SHORT_US + MD_PULSE_LONG_US,
+    MD_PULSE_RESET_LOW_US, (MD_PULSE_RESET_HIGH_US) + MD_PULSE_SHORT_US,
+  };
+
+  md_send_slot_t queue[MD_SEND_QUEUE_LEN];
+  uint32_t queue_seq;
+  md_send_queue_stats_t queue_stats;
+
+  // adaptive polling
+  uint32_t poll_us = MD_SEND_POLL_MAX_US;
+  unsigned long poll_quiet_since;   // last header without TX_READY
+  bool poll_remote_waiting;
+  md_send_poll_stats_t poll_stats;
+  unsigned long poll_stats_start;
+  uint64_t poll_latency_total;
+
+  md_wave_step_t wave[MD_SEND_WAVE_LEN];
+  uint16_t wave_len;
+  volatile uint16_t wave_idx;
+  bool wave_released;
+  // what MD_WAVE_SAMPLE has read back. The header, or a whole remote packet
+  uint8_t wave_read[11];
+  uint8_t wave_read_bit;
+  bool wave_is_read;
+
+  // the last packet read from the remote, waiting for md_send_loop() to hand it over
+  uint8_t read_buffer[10];
+  volatile bool read_ready;
+  bool read_parity_ok;
+#if MD_SEND_ASYNC
+  IntervalTimer wave_timer;
+  volatile bool wave_busy;
+  // the timer is done with it, md_send_loop() hasn't been round yet
+  volatile bool wave_finished;
+#endif
+} md_send_t;
+
+// sony_md_protocol_state.cpp
+typedef struct md_proto_t {
+#if MD_TITLE_CACHE_ENTRIES
+  md_title_cache_t title_cache[MD_TITLE_CACHE_ENTRIES];
+  uint32_t title_cache_clock;
+  // the cached title for this track, already given to md_text_received_cb()
+  md_title_cache_t *title_hit;
+#endif
+  md_text_store_t rx_text;        // from the player
+  md_text_store_t tx_text;        // to the remote
+  bool send_text;
+  // the app takes text with md_text_read(), so the player can be held off for it
+  bool text_streamed;
+
+  uint8_t backlight_val;
+  uint8_t volume_val;
+  uint8_t play_mode_val;
+  uint8_t play_state_val;
+  uint8_t track_val;
+  uint8_t battery_val;
+  uint8_t eq_val;
+  uint8_t alarm_val;
+  uint8_t rec_indicator_val;
+
+  bool recv_enabled;
+  // one bit per command table row, set when a setter changes its value
+  uint16_t dirty;
+  // the rows md_sync_device() still has to get out
+  uint16_t sync;
+  // and set once the player has told us the value, so the first one is an event
+  uint16_t seen;
+  md_event_listener_t listeners[MD_EVENT_LISTENERS];
+} md_proto_t;
+
+struct md_bus_t;
+
+// sony_md_proxy.cpp. One for each player/remote pair
+typedef struct md_proxy_t {
+  struct md_bus_t *player;        // we are the remote on this one
+  struct md_bus_t *remote;        // and the player on this one
+  // player frames waiting to go to the remote, oldest first
+  md_frame_t queue[MD_PROXY_QUEUE_LEN];
+  uint8_t queue_len;
+  uint8_t header;                 // the remote's header bits the player is seeing
+  md_proxy_stats_t stats;
+  uint64_t delay_total;
+} md_proxy_t;
+
+typedef struct md_bus_t {
+  uint8_t id;                     // where it is in the bus list, picks the trampolines
+  uint8_t data_pin = MD_DATA_PIN;
+  uint8_t send_pin = MD_SEND_DATA_PIN;
+  md_recv_t recv;
+  md_send_t send;
+  md_proto_t proto;
+  md_proxy_t *proxy;              // set when this bus is one side of a proxy
+} md_bus_t;
+
+// the bus all the md_* calls work on
+extern MD_BUS_TLS md_bus_t *_md_bus;
+// the one you get without asking, on MD_DATA_PIN/MD_SEND_DATA_PIN
+extern md_bus_t md_bus_default;
+
+// Add another bus on its own pins. Call md_setup() with it selected after.
+// @returns false if there are MD_BUS_MAX already
+bool md_bus_init(md_bus_t *bus, uint8_t data_pin, uint8_t send_pin);
+// make the md_* calls work on this bus
+void md_bus_select(md_bus_t *bus);
+md_bus_t *md_bus_current();
+md_bus_t *md_bus_get(uint8_t id);
+
+// Interrupt and timer callbacks don't get told which bus they are for, so
+// each bus gets its own little function that selects it then calls fn.
+// MD_BUS_TRAMPOLINES(fn) makes fn_trampolines[MD_BUS_MAX]
+template <uint8_t N, void (*fn)()> void _md_bus_trampoline() {
+  md_bus_t *prev = _md_bus;
+  _md_bus = md_bus_get(N);
+  fn();
+  _md_bus = prev;
+}
+
+// 0 .. MD_BUS_MAX - 1, so there is one trampoline per bus whatever MD_BUS_MAX is
+template <uint8_t... N> struct _md_bus_ids {};
+template <uint8_t C, uint8_t... N> struct _md_bus_make_ids : _md_bus_make_ids<C - 1, C - 1, N...> {};
+template <uint8_t... N> struct _md_bus_make_ids<0, N...> {
+  typedef _md_bus_ids<N...> type;
+};
+
+template <void (*fn)(), typename ids> struct _md_bus_trampoline_list;
+template <void (*fn)(), uint8_t... N> struct _md_bus_trampoline_list<fn, _md_bus_ids<N...>> {
+  static void (*const list[sizeof...(N)])();
+};
+template <void (*fn)(), uint8_t... N>
+void (*const _md_bus_trampoline_list<fn, _md_bus_ids<N...>>::list[sizeof...(N)])() = {
+  _md_bus_trampoline<N, fn>...
+};
+
+#define MD_BUS_TRAMPOLINES(fn) \
+  typedef _md_bus_trampoline_list<fn, _md_bus_make_ids<MD_BUS_MAX>::type> fn##_trampoline_list; \
+  static_assert(sizeof(fn##_trampoline_list::list) / sizeof(fn##_trampoline_list::list[0]) == MD_BUS_MAX, \
+    "one trampoline for each bus"); \
+  static void (*const *const fn##_trampolines)() = fn##_trampoline_list::list
@@ -0,0 +1,63 @@
+/*
+ * Sony MD Remote edge capture format
+ * Barry Carter 2022 <barry.carter@gmail.com>
+ *
+ * What raw/GenericProtocolPoller streams, and md_trace_decode reads.
+ *
+ * A md_cap_header_t, then one varint per edge: the ticks since the edge
+ * before (or since start_tick for the first one). The line starts at
+ * header.level and flips on every edge, so the levels aren't stored.
+ *
+ * A 0 delta can't happen, so it starts an escape:
+ *  0 MD_CAP_ESC_LOST varint(edges) level   edges went missing, level is the
+ *                                          line after the next edge
+ *  0 MD_CAP_ESC_IDLE varint(ticks)         nothing happened for ages, add
+ *                                          this to the next delta
+ *
+ * Varints are 7 bits a byte, low bits first, top bit set on all but the last.
+ * Nothing Arduino in here, it's used on Linux too.
+ */
+#pragma once
+#include <stdint.h>
+
+#define MD_CAP_MAGIC            "MDE1"
+#define MD_CAP_VERSION          1
+
+#define MD_CAP_ESC_LOST         1
+#define MD_CAP_ESC_IDLE         2
+
+typedef struct __attribute__((packed)) md_cap_header_t {
+  char magic[4];                  // MD_CAP_MAGIC
+  uint8_t version;
+  uint8_t pin;                    // what was captured
+  uint8_t level;                  // the line when the capture started
+  uint8_t reserved;
+  uint32_t clock_hz;              // ticks per second
+  uint32_t start_time;            // unix time from the RTC, 0 if it wasn't set
+  uint32_t start_tick;            // the tick count the capture started at
+} md_cap_header_t;
+
+// @returns how many bytes it took, at most 5
+static inline uint8_t md_cap_put_varint(uint8_t *out, uint32_t val) {
+  uint8_t len = 0;
+  while (val >= 0x80) {
+    out[len++] = (val & 0x7F) | 0x80;
+    val >>= 7;
+  }
+  out[len++] = val;
+  return len;
+}
+
+// @returns false if it runs off the end
+static inline bool md_cap_get_varint(const uint8_t **p, const uint8_t *end, uint32_t *val) {
+  uint32_t v = 0;
+  for (uint8_t shift = 0; *p < end && shift < 35; shift += 7) {
+    uint8_t b = *(*p)++;
+    v |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      *val = v;
+      return true;
+    }
+  }
+  return false;
+}
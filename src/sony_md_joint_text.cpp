@@ -104,18 +104,17 @@ void  md_jt_send_text(char *text) {
   int i = 0;
   for  (int a = 0; a < strlen(text); a++) {
     if (a % 7 ==0 && a > 0) {
+      MD_LOG(MD_LOG_DEBUG, MD_LOG_TAG_JT_TEXT, &send_buf[REG_TEXT_POSITION], 7);
       md_send_packet(send_buf, 10);
       memset(send_buf, 0, sizeof(send_buf));
       delayMicroseconds(30000);
       i = 0;
     }
     send_buf[REG_TEXT_POSITION + i] = text[a];
-    Serial.print(" ");
-    Serial.print(send_buf[REG_TEXT_POSITION + i], HEX);
-    
     i++;
   }
   delayMicroseconds(30000);
+  MD_LOG(MD_LOG_DEBUG, MD_LOG_TAG_JT_TEXT, &send_buf[REG_TEXT_POSITION], i);
   md_send_packet(send_buf, 10);
 
 
@@ -0,0 +1,120 @@
+/*
+ * Sony MD Remote logging
+ * Barry Carter 2022 <barry.carter@gmail.com>
+ *
+ * Printing from the middle of a frame throws the timing out, and building
+ * strings up allocates. So the library just drops a small fixed record in
+ * a ring with MD_LOG(), and md_log_drain() hands them to the sink later.
+ *
+ * The default sink prints a line of hex per record:
+ *  <micros> <bus> <level> <tag> xx xx xx...
+ * Set your own with md_log_set_sink(), e.g. to keep them somewhere else.
+ */
+#include "sony_md_remote.h"
+
+static md_log_record_t _log_ring[MD_LOG_RING_LEN];
+static volatile uint8_t _log_head;
+static volatile uint8_t _log_tail;
+static volatile uint32_t _log_dropped;
+static md_log_sink_t _log_sink = md_log_sink_hex;
+
+static const char _log_levels[] = "-EWID";
+static const char *_log_tags[] = {
+  "RECV", "PARITY", "RESET", "SEND", "REMOTE", "WAVE", "JTTEXT",
+};
+
+// MD_LOG() goes off in the receive interrupt too, where turning interrupts
+// back on at the end would be wrong. So put them back how they were
+#if defined(__arm__)
+static inline uint32_t _md_log_lock() {
+  uint32_t primask;
+  __asm__ volatile("mrs %0, primask" : "=r" (primask) :: "memory");
+  __disable_irq();
+  return primask;
+}
+
+static inline void _md_log_unlock(uint32_t primask) {
+  __asm__ volatile("msr primask, %0" :: "r" (primask) : "memory");
+}
+#else
+// tools/host has these
+static inline uint32_t _md_log_lock() {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  return primask;
+}
+
+static inline void _md_log_unlock(uint32_t primask) {
+  __set_PRIMASK(primask);
+}
+#endif
+
+void md_log_write(uint8_t level, uint8_t tag, const uint8_t *data, uint8_t len) {
+  if (len > sizeof(_log_ring[0].data))
+    len = sizeof(_log_ring[0].data);
+
+  uint32_t primask = _md_log_lock();
+  uint8_t head = _log_head;
+  if ((uint8_t)(head - _log_tail) >= MD_LOG_RING_LEN) {
+    _log_dropped++;
+    _md_log_unlock(primask);
+    return;
+  }
+  md_log_record_t *rec = &_log_ring[head & (MD_LOG_RING_LEN - 1)];
+  rec->stamp = micros();
+  rec->level = level;
+  rec->tag = tag;
+  rec->bus = _md_bus->id;
+  rec->len = len;
+  memcpy(rec->data, data, len);
+  _log_head = head + 1;
+  _md_log_unlock(primask);
+}
+
+void md_log_drain() {
+  while (_log_tail != _log_head) {
+    md_log_record_t *rec = &_log_ring[_log_tail & (MD_LOG_RING_LEN - 1)];
+    if (_log_sink)
+      _log_sink(rec);
+    _log_tail = _log_tail + 1;
+  }
+}
+
+void md_log_set_sink(md_log_sink_t sink) {
+  _log_sink = sink;
+}
+
+uint32_t md_log_get_dropped() {
+  return _log_dropped;
+}
+
+static char *_md_log_hex(char *out, uint32_t val, uint8_t digits) {
+  static const char hex[] = "0123456789abcdef";
+  while (digits--)
+    *out++ = hex[(val >> (digits * 4)) & 0xF];
+  return out;
+}
+
+void md_log_sink_hex(const md_log_record_t *rec) {
+  // stamp, bus, level, tag, 3 chars a byte
+  char line[8 + 4 + 2 + 8 + 3 * sizeof(rec->data) + 2];
+  char *p = _md_log_hex(line, rec->stamp, 8);
+  *p++ = ' ';
+  p = _md_log_hex(p, rec->bus, 1);
+  *p++ = ' ';
+  *p++ = rec->level < sizeof(_log_levels) - 1 ? _log_levels[rec->level] : '?';
+  *p++ = ' ';
+  const char *tag = rec->tag < sizeof(_log_tags) / sizeof(_log_tags[0]) ? _log_tags[rec->tag] : "?";
+  while (*tag)
+    *p++ = *tag++;
+  for (uint8_t i = 0; i < rec->len; i++) {
+    *p++ = ' ';
+    p = _md_log_hex(p, rec->data[i], 2);
+  }
+  *p = 0;
+  MD_SERIAL_PORT.println(line);
+}
+
+void md_log_sink_binary(const md_log_record_t *rec) {
+  MD_SERIAL_PORT.write((const uint8_t *)rec, sizeof(*rec));
+}
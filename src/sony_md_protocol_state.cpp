@@ -7,6 +7,8 @@
  * 
  * The only requirement is you call md_loop() as fast as you can,
  * Use the getters and setters, then _send() to send to a MD device
+ * The _send() calls queue the update, md_loop() sends it when the bus is free
+ * Or just use the setters and call md_sync_device() to send whatever changed
  * 
  * Example:
  * 
@@ -21,89 +23,197 @@
 #include "sony_md_remote.h"
 #include <stdio.h>
 
-static void _md_set_battery_raw(uint8_t *data);
+
+// this bus' state, see md_proto_t
+#define _proto (_md_bus->proto)
+
+void _md_capabilities_raw(uint8_t *data);
+static void _md_reset_text();
+static uint8_t _md_text_free_pages(md_text_store_t *st);
+static void _md_set_text_raw(uint8_t *data);
 static void _md_set_track_raw(uint8_t *data);
-static void _md_set_play_state_raw(uint8_t *data);
 static void _md_set_disp_raw(uint8_t *data);
+static void _md_disp_mode_encode(uint8_t *buf);
+
+// What each command looks like. Most are a single value in one register,
+// which is copied to/from val. decode/encode are for anything more
+typedef struct md_cmd_desc_t {
+  uint8_t cmd;
+  uint8_t reg;
+  uint8_t md_proto_t::*val;
+  // MD_EVENT_* for when the player changes val
+  uint8_t event;
+  // called with a packet from the player, before val is updated
+  void (*decode)(uint8_t *data);
+  // called to fill in the rest of a packet we are sending, after val
+  void (*encode)(uint8_t *buf);
+} md_cmd_desc_t;
+
+static constexpr md_cmd_desc_t _cmd_descs[] = {
+  { CMD_CAPABILITIES,     REG_CAPABILITIES_BLOCK,   NULL,                           MD_EVENT_NONE,          _md_capabilities_raw, NULL },
+  { CMD_UNKNOWN_02,       0,                        NULL,                           MD_EVENT_NONE,          NULL,                 NULL },
+  { CMD_DISP_MODE_MAYBE,  0,                        NULL,                           MD_EVENT_NONE,          NULL,                 _md_disp_mode_encode },
+  { CMD_BACKLIGHT,        REG_BACKLIGHT,            &md_proto_t::backlight_val,     MD_EVENT_BACKLIGHT,     NULL,                 NULL },
+  { CMD_VOLUME,           REG_VOLUME,               &md_proto_t::volume_val,        MD_EVENT_VOLUME,        NULL,                 NULL },
+  { CMD_PLAY_MODE,        REG_PLAY_MODE,            &md_proto_t::play_mode_val,     MD_EVENT_PLAY_MODE,     NULL,                 NULL },
+  { CMD_REC_MODE,         REG_RECORDING_INDICATOR,  &md_proto_t::rec_indicator_val, MD_EVENT_REC_INDICATOR, NULL,                 NULL },
+  { CMD_BATTERY,          REG_BATTERY,              &md_proto_t::battery_val,       MD_EVENT_BATTERY,       NULL,                 NULL },
+  { CMD_EQ,               REG_EQ,                   &md_proto_t::eq_val,            MD_EVENT_EQ,            NULL,                 NULL },
+  { CMD_ALARM,            REG_ALARM_INDICATOR,      &md_proto_t::alarm_val,         MD_EVENT_ALARM,         NULL,                 NULL },
+  { CMD_TRACK,            REG_TRACK,                &md_proto_t::track_val,         MD_EVENT_TRACK,         _md_set_track_raw,    NULL },
+  { CMD_PLAY_STATE,       REG_PLAY_STATE,           &md_proto_t::play_state_val,    MD_EVENT_PLAY_STATE,    NULL,                 NULL },
+  { CMD_DISP_MAYBE,       0,                        NULL,                           MD_EVENT_NONE,          _md_set_disp_raw,     NULL },
+  { CMD_TEXT,             REG_TEXT,                 NULL,                           MD_EVENT_TEXT,          _md_set_text_raw,     NULL },
+};
+
+#define MD_CMD_DESC_COUNT  (sizeof(_cmd_descs) / sizeof(_cmd_descs[0]))
+
+// command byte -> 1 + where it is in _cmd_descs, 0 if we don't know it
+struct md_cmd_index_t {
+  uint8_t idx[256];
+
+  constexpr md_cmd_index_t() : idx() {
+    for (uint8_t i = 0; i < MD_CMD_DESC_COUNT; i++)
+      idx[_cmd_descs[i].cmd] = i + 1;
+  }
+};
 
-// feature vars
-char text[MAX_TEXT_LEN];
-static uint8_t _cur_text_len = 0;
-static uint8_t _text_send_idx = 0;
-static bool _send_text = false;;
+static constexpr md_cmd_index_t _cmd_index;
 
-uint8_t backlight_val = 0;
-uint8_t volume_val = 0;
-uint8_t play_mode_val = 0;
-uint8_t play_state_val = 0;
-uint8_t track_val;
-uint8_t battery_val;
-uint8_t eq_val;
-uint8_t alarm_val;
-uint8_t rec_indicator_val;
+static const md_cmd_desc_t *_md_cmd_find(uint8_t cmd) {
+  uint8_t i = _cmd_index.idx[cmd];
+  return i ? &_cmd_descs[i - 1] : NULL;
+}
 
-bool _recv_enabled;
+static_assert(MD_CMD_DESC_COUNT <= 16, "_proto.dirty needs more bits");
 
-static bool _text_done = false;
+// change a value through its descriptor, flagging it for md_sync_device()
+static void _md_cmd_set(uint8_t cmd, uint8_t val) {
+  uint8_t i = _cmd_index.idx[cmd] - 1;
+  if (_proto.*_cmd_descs[i].val == val)
+    return;
+  _proto.*_cmd_descs[i].val = val;
+  _proto.dirty |= 1 << i;
+}
 
-void _md_capabilities_raw(uint8_t *data);
-static void _md_reset_text();
-static void _md_set_text_raw(uint8_t *data);
-void _md_set_battery_raw(uint8_t *data);
-static void _md_set_track_raw(uint8_t *data);
-void _md_set_play_state_raw(uint8_t *data) ;
-void _md_set_disp_raw(uint8_t *data);
-static void _md_set_backlight_raw(uint8_t *data);
-void _md_set_volume_raw(uint8_t *data);
-void _md_set_play_mode_raw(uint8_t *data);
-void _md_set_rec_mode_raw(uint8_t *data);
-void _md_set_eq_raw(uint8_t *data);
-void _md_set_alarm_raw(uint8_t *data);
+static void _md_event_emit(md_event_t *event) {
+  for (uint8_t i = 0; i < MD_EVENT_LISTENERS; i++) {
+    md_event_listener_t *l = &_proto.listeners[i];
+    if (l->cb && (l->mask & MD_EVENT_MASK(event->type)))
+      l->cb(event, l->ctx);
+  }
+}
+
+// a value from the player. Only an event if it's new
+static void _md_cmd_update(const md_cmd_desc_t *desc, uint8_t val) {
+  uint16_t bit = 1 << (desc - _cmd_descs);
+  uint8_t prev = _proto.*desc->val;
+  if ((_proto.seen & bit) && prev == val)
+    return;
+  _proto.*desc->val = val;
+  md_event_t event = { desc->event, val, (_proto.seen & bit) ? prev : val, NULL, 0, false };
+  _proto.seen |= bit;
+  _md_event_emit(&event);
+}
+
+// a whole lot of text from the player, or the cache
+static void _md_text_done(char *text, uint16_t len, bool truncated) {
+  md_text_received_cb(text, len > 255 ? 255 : len);
+  md_event_t event = { MD_EVENT_TEXT, 0, 0, text, len, truncated };
+  _md_event_emit(&event);
+}
+
+int8_t md_event_subscribe(uint16_t mask, md_event_cb_t cb, void *ctx) {
+  for (uint8_t i = 0; i < MD_EVENT_LISTENERS; i++) {
+    md_event_listener_t *l = &_proto.listeners[i];
+    if (l->cb)
+      continue;
+    l->cb = cb;
+    l->mask = mask;
+    l->ctx = ctx;
+    return i;
+  }
+  return -1;
+}
+
+void md_event_unsubscribe(int8_t handle) {
+  if (handle >= 0 && handle < MD_EVENT_LISTENERS)
+    _proto.listeners[handle].cb = NULL;
+}
 
 void md_packet_parse(uint8_t *data) {
-  switch(data[0]) {
-    case CMD_CAPABILITIES:
-      _md_capabilities_raw(data);
-    case CMD_TEXT:
-      _md_set_text_raw(data);
-      break;
-    case CMD_BACKLIGHT:
-      _md_set_backlight_raw(data);
-      break;
-    case CMD_VOLUME:
-      _md_set_volume_raw(data);
-      break;
-    case CMD_PLAY_MODE:
-      _md_set_play_mode_raw(data);
-      break;
-    case CMD_REC_MODE:
-      _md_set_rec_mode_raw(data);
-      break;
-    case CMD_BATTERY:
-      _md_set_battery_raw(data);
-      break;
-    case CMD_EQ:
-      _md_set_eq_raw(data);
-      break;
-    case CMD_ALARM:
-      _md_set_alarm_raw(data);
-      break;
-    case CMD_TRACK:
-      _md_set_track_raw(data);
-      break;
-    case CMD_PLAY_STATE:
-      _md_set_play_state_raw(data);
-      break;
-    case CMD_DISP_MAYBE:
-      _md_set_disp_raw(data);
-      break;
-    default:
-      break;
+  const md_cmd_desc_t *desc = _md_cmd_find(data[0]);
+  if (!desc)
+    return;
+  if (desc->decode)
+    desc->decode(data);
+  if (desc->val)
+    _md_cmd_update(desc, data[desc->reg]);
+}
+
+// fill in a packet for cmd from the current state
+static void _md_cmd_encode(const md_cmd_desc_t *desc, uint8_t cmd, uint8_t *buf) {
+  buf[0] = cmd;
+  if (desc && desc->val)
+    buf[desc->reg] = _proto.*desc->val;
+  if (desc && desc->encode)
+    desc->encode(buf);
+}
+
+// and queue it. It stays dirty until it has actually gone, see _md_cmd_sent()
+static bool _md_cmd_send(uint8_t cmd) {
+  uint8_t *send_buf = md_get_send_buf();
+  _md_cmd_encode(_md_cmd_find(cmd), cmd, send_buf);
+  return md_send_queue(send_buf, 10);
+}
+
+void _md_cmd_sent(uint8_t *data) {
+  const md_cmd_desc_t *desc = _md_cmd_find(data[0]);
+  if (!desc)
+    return;
+  // it was changed again while it was waiting, that still has to go
+  uint8_t buf[10] = { 0 };
+  _md_cmd_encode(desc, data[0], buf);
+  if (memcmp(buf, data, sizeof(buf)))
+    return;
+  uint16_t bit = 1 << (desc - _cmd_descs);
+  _proto.dirty &= ~bit;
+  _proto.sync &= ~bit;
+}
+
+// Queue what md_sync_device() asked for, as the queue has room for it.
+// Anything that got pushed out of the queue goes in again
+static void _md_sync_drain() {
+  // in table order, and the queue sorts out what goes first
+  for (uint8_t i = 0; _proto.sync && i < MD_CMD_DESC_COUNT; i++) {
+    if (!(_proto.sync & (1 << i)))
+      continue;
+    // still waiting. If it changes before it goes, it stays on the list
+    if (md_send_is_queued(_cmd_descs[i].cmd))
+      continue;
+    // don't push anything else out for it
+    if (!md_send_queue_space() || !_md_cmd_send(_cmd_descs[i].cmd))
+      return;
   }
 }
 
+void md_sync_device() {
+  _proto.sync |= _proto.dirty;
+  _md_sync_drain();
+}
+
+void md_resync_device() {
+  for (uint8_t i = 0; i < MD_CMD_DESC_COUNT; i++) {
+    if (_cmd_descs[i].val)
+      _proto.dirty |= 1 << i;
+  }
+  md_sync_device();
+  if (_proto.tx_text.pages)
+    md_send_text();
+}
+
 void md_recv_enable(bool is_enabled) {
-  _recv_enabled = is_enabled;
+  _proto.recv_enabled = is_enabled;
 }
 
 void _md_capabilities_raw(uint8_t *data) {
@@ -185,300 +295,417 @@ block 6
 void md_request_capabilities(uint8_t block) {
   uint8_t *send_buf = md_get_send_buf();
   send_buf[0] = CMD_CAPABILITIES;
-  send_buf[1] = block;
-  md_send_packet(send_buf, 10);   
+  // where _md_capabilities_raw() looks for it
+  send_buf[REG_CAPABILITIES_BLOCK] = block;
+  md_send_queue(send_buf, 10);   
+}
+
+static void _md_text_clear(md_text_store_t *st) {
+  st->head = 0;
+  st->pages = 0;
+  st->tail_len = 0;
+  st->done = 0;
+  st->closed = false;
+  st->read = false;
+  st->truncated = false;
+  st->buf[0] = 0;
+}
+
+static char *_md_text_page(md_text_store_t *st, uint8_t page) {
+  return &st->buf[((st->head + page) % MD_TEXT_POOL_PAGES) * REG_TEXT_LEN];
+}
+
+static uint8_t _md_text_page_len(md_text_store_t *st, uint8_t page) {
+  return page == st->pages - 1 ? st->tail_len : REG_TEXT_LEN;
+}
+
+// give the pages that are done back to the ring
+static void _md_text_reclaim(md_text_store_t *st) {
+  st->head = (st->head + st->done) % MD_TEXT_POOL_PAGES;
+  st->pages -= st->done;
+  st->done = 0;
+  if (!st->pages)
+    st->tail_len = 0;
+}
+
+static uint8_t _md_text_free_pages(md_text_store_t *st) {
+  return MD_TEXT_POOL_PAGES - st->pages + st->done;
+}
+
+// @returns how much of it fitted
+static uint16_t _md_text_write(md_text_store_t *st, const char *src, uint16_t len) {
+  uint16_t written = 0;
+  while (written < len) {
+    if (!st->pages || st->tail_len == REG_TEXT_LEN) {
+      if (st->pages == MD_TEXT_POOL_PAGES)
+        _md_text_reclaim(st);
+      if (st->pages == MD_TEXT_POOL_PAGES)
+        break;
+      st->pages++;
+      st->tail_len = 0;
+    }
+    _md_text_page(st, st->pages - 1)[st->tail_len++] = src[written++];
+  }
+  return written;
+}
+
+static void _md_reverse(char *a, char *b) {
+  while (a < --b) {
+    char c = *a;
+    *a++ = *b;
+    *b = c;
+  }
+}
+
+// Rotate the ring in place so the text starts at the front and is in one
+// piece, and null term it. @returns the text not done yet
+static char *_md_text_linear(md_text_store_t *st, uint16_t *len) {
+  char *buf = st->buf;
+  if (st->head) {
+    char *mid = buf + st->head * REG_TEXT_LEN;
+    char *end = buf + MD_TEXT_POOL_PAGES * REG_TEXT_LEN;
+    _md_reverse(buf, mid);
+    _md_reverse(mid, end);
+    _md_reverse(buf, end);
+    st->head = 0;
+  }
+
+  uint16_t total = st->pages ? (st->pages - 1) * REG_TEXT_LEN + st->tail_len : 0;
+  buf[total] = 0;
+  buf += st->done * REG_TEXT_LEN;
+  *len = strlen(buf);
+  return buf;
 }
 
 char *md_get_text() {
-  return text;
+  uint16_t len;
+#if MD_TITLE_CACHE_ENTRIES
+  // while the bus catches up with it
+  if (_proto.title_hit && !_proto.rx_text.closed)
+    return _proto.title_hit->title;
+#endif
+  return _md_text_linear(&_proto.rx_text, &len);
+}
+
+uint16_t md_text_read(char *buf, uint16_t len) {
+  uint16_t copied = 0;
+  // only whole pages, unless it's all in
+  while (_proto.rx_text.done < _proto.rx_text.pages) {
+    uint8_t page_len = _md_text_page_len(&_proto.rx_text, _proto.rx_text.done);
+    if ((page_len < REG_TEXT_LEN && !_proto.rx_text.closed) || copied + page_len > len)
+      break;
+    memcpy(buf + copied, _md_text_page(&_proto.rx_text, _proto.rx_text.done), page_len);
+    copied += page_len;
+    _proto.rx_text.done++;
+    _proto.rx_text.read = true;
+  }
+  _md_text_reclaim(&_proto.rx_text);
+  _proto.text_streamed = true;
+
+  // room again, ask for the rest of it
+  if (!_proto.rx_text.closed && _proto.rx_text.pages && _md_text_free_pages(&_proto.rx_text))
+    md_recv_set_mode(MD_HEADER_REMOTE_READY_FOR_TEXT);
+  return copied;
+}
+
+uint16_t md_set_text(char *newtext) {
+  _md_text_clear(&_proto.tx_text);
+  // the null goes too, so there has to be room left for it. If the text is
+  // only one bank, it sends two to wipe the second
+  uint16_t len = strlen(newtext);
+  if (len > MD_TEXT_POOL_PAGES * REG_TEXT_LEN - 1)
+    len = MD_TEXT_POOL_PAGES * REG_TEXT_LEN - 1;
+  _md_text_write(&_proto.tx_text, newtext, len);
+  md_text_write_end();
+  _proto.send_text = true;
+  return len;
 }
 
-void md_set_text(char *newtext) {
-  strcpy(text, newtext);
-  _cur_text_len = strlen(newtext) + 1;
-  // if the text is only one bank, send two to wipe the second
-  _send_text = true;
-  _text_send_idx = 0;
+bool md_text_truncated() {
+  return _proto.rx_text.truncated;
+}
+
+uint16_t md_text_write(const char *src, uint16_t len) {
+  // a new lot of text
+  if (_proto.tx_text.closed)
+    _md_text_clear(&_proto.tx_text);
+  _proto.send_text = true;
+  return _md_text_write(&_proto.tx_text, src, len);
+}
+
+void md_text_write_end() {
+  char end = 0;
+  _md_text_write(&_proto.tx_text, &end, 1);
+  _proto.tx_text.closed = true;
+}
+
+// is there a whole chunk ready to go
+static bool _md_text_tx_ready() {
+  if (_proto.tx_text.done >= _proto.tx_text.pages)
+    return false;
+  return _proto.tx_text.closed || _md_text_page_len(&_proto.tx_text, _proto.tx_text.done) == REG_TEXT_LEN;
 }
 
 bool md_send_text() {
-  _send_text = true;
-  _text_send_idx = 0;
+  // from the start of whatever is still in the ring
+  _proto.tx_text.done = 0;
+  _proto.send_text = true;
   // send the first block, the rest goes async
-  _md_send_text();
+  return _md_send_text();
 }
 
 bool _md_send_text() {
+  if (!_md_text_tx_ready())
+    return false;
+
   uint8_t *send_buf = md_get_send_buf();
-  uint8_t sub_cmd = CMD_TEXT_APPEND;
-    
-  send_buf[0] = CMD_TEXT;
-  //send_buf[2] = 0x01;
+  uint8_t page = _proto.tx_text.done++;
+  char *chunk = _md_text_page(&_proto.tx_text, page);
+  uint8_t len = _md_text_page_len(&_proto.tx_text, page);
+  bool last = _proto.tx_text.closed && _proto.tx_text.done == _proto.tx_text.pages;
 
-  // less than 7 bytes of text left. flag as done
-  if ((_cur_text_len - _text_send_idx) <= 7)
-    sub_cmd = CMD_TEXT_END;
+  send_buf[0] = CMD_TEXT;
+  send_buf[REG_TEXT] = last ? CMD_TEXT_END : CMD_TEXT_APPEND;
 
-  for(int i = 0; i < 7; i++) {
-    if (text[_text_send_idx] == 0) {
-      send_buf[REG_TEXT_POSITION + i] = 0xFF;
-    }
-    else
-      send_buf[REG_TEXT_POSITION + i] = text[_text_send_idx];
-    
-    _text_send_idx++;
-
-    if (_text_send_idx >= _cur_text_len) {
-      _send_text = false;
-      if (i == 7)
-        send_buf[REG_TEXT_POSITION + i] = 0xFF;
-      else
-        send_buf[REG_TEXT_POSITION + i] = ' ';
-    }
+  // pad out with spaces after the end
+  for (int i = 0; i < REG_TEXT_LEN; i++) {
+    if (i >= len || chunk[i] == 0)
+      len = i;
+    send_buf[REG_TEXT_POSITION + i] = i < len ? chunk[i] : ' ';
   }
-  if (!_send_text)
-    _text_send_idx = 0;
-  send_buf[REG_TEXT] = sub_cmd;
-  Serial.println("T");
-  uint8_t v = md_send_packet(send_buf, 10);
+
+  if (last)
+    _proto.send_text = false;
+  md_send_queue(send_buf, 10);
 
   // send our completeness status
-  return _text_send_idx == 0;
+  return last;
 }
 
 static void _md_reset_text() {
-  _cur_text_len = 0;
-  text[0] = 0;
-  _text_send_idx = 0;
+  _md_text_clear(&_proto.rx_text);
+}
+
+#if MD_TITLE_CACHE_ENTRIES
+static md_title_cache_t *_md_title_find(uint8_t track) {
+  for (int i = 0; i < MD_TITLE_CACHE_ENTRIES; i++) {
+    if (_proto.title_cache[i].used && _proto.title_cache[i].track == track) {
+      _proto.title_cache[i].last_used = ++_proto.title_cache_clock;
+      return &_proto.title_cache[i];
+    }
+  }
+  return NULL;
 }
 
+// remember a title, over the oldest one if it's full
+static md_title_cache_t *_md_title_store(uint8_t track, const char *title, uint16_t len) {
+  if (len >= MD_TITLE_CACHE_LEN)
+    return NULL;
+
+  md_title_cache_t *entry = _md_title_find(track);
+  for (int i = 0; !entry && i < MD_TITLE_CACHE_ENTRIES; i++) {
+    if (!_proto.title_cache[i].used)
+      entry = &_proto.title_cache[i];
+  }
+  for (int i = 0; !entry && i < MD_TITLE_CACHE_ENTRIES; i++) {
+    if (i == 0 || _proto.title_cache[i].last_used < entry->last_used)
+      entry = &_proto.title_cache[i];
+  }
+  entry->used = true;
+  entry->track = track;
+  entry->last_used = ++_proto.title_cache_clock;
+  memcpy(entry->title, title, len);
+  entry->title[len] = 0;
+  return entry;
+}
+#endif
+
 static void _md_set_text_raw(uint8_t *data) {
   uint8_t reg = data[REG_TEXT];
   // the next time we get some text, check to see if we need to reset the buffer instead of appending
-  if (_text_done) {
-    _text_done = false;
-    _cur_text_len = 0;
-  }
+  if (_proto.rx_text.closed)
+    _md_text_clear(&_proto.rx_text);
 
-  // set the mode to more text please
-  md_recv_set_mode(MD_HEADER_REMOTE_READY_FOR_TEXT);
-  
   // clear the request time mode bit when we get any text
   md_recv_clear_mode(MD_HEADER_REMOTE_TIMER);
   
-  // just keep appending text
-  for(int i = 0; i < REG_TEXT_LEN; i++) {
-    // 0xFF is the end of text signal
-    if (data[i + REG_TEXT_POSITION] == 0xFF) {
-      text[_cur_text_len] = 0;
-      _text_done = true;
-    } else {  
-      text[_cur_text_len] = (char)(data[i + REG_TEXT_POSITION]);
-    }
-
-    _cur_text_len++;
-    
-    // don't overflow the text buffer
-    if (_cur_text_len > MAX_TEXT_LEN)
-      _cur_text_len = 0;
-
-    // null term it
-    text[_cur_text_len] = 0;
-  }
+  // 0xFF is the end of text signal
+  uint8_t len = 0;
+  while (len < REG_TEXT_LEN && data[len + REG_TEXT_POSITION] != 0xFF)
+    len++;
+  // no room, the player didn't wait or nobody is reading it as it comes.
+  // Lose the rest rather than wrap over the start
+  if (_md_text_write(&_proto.rx_text, (char *)&data[REG_TEXT_POSITION], len) < len)
+    _proto.rx_text.truncated = true;
   
   // last chunk of text received
   if (reg == CMD_TEXT_END) {
+    _proto.rx_text.closed = true;
     md_recv_clear_mode(MD_HEADER_REMOTE_READY_FOR_TEXT);
-    md_text_received_cb(text, (uint8_t)_cur_text_len);
-    _text_done = true;
-  }  
-}
+    uint16_t text_len;
+    char *text = _md_text_linear(&_proto.rx_text, &text_len);
+#if MD_TITLE_CACHE_ENTRIES
+    // the player just told us what we already showed
+    if (_proto.title_hit && _proto.title_hit->track == _proto.track_val && !strcmp(_proto.title_hit->title, text))
+      return;
+    // only the whole of it is worth keeping
+    if (!_proto.rx_text.read && !_proto.rx_text.truncated)
+      _proto.title_hit = _md_title_store(_proto.track_val, text, text_len);
+    else
+      _proto.title_hit = NULL;
+#endif
+    _md_text_done(text, text_len, _proto.rx_text.truncated);
+    return;
+  }
 
-void md_set_backlight(bool isOn) {
-  if (isOn)
-    backlight_val = BACKLIGHT_ON;
+  // more text please. Only hold the player off for the app to read it,
+  // otherwise it would wait forever. The rest is lost then
+  if (_md_text_free_pages(&_proto.rx_text) || !_proto.text_streamed)
+    md_recv_set_mode(MD_HEADER_REMOTE_READY_FOR_TEXT);
   else
-    backlight_val = BACKLIGHT_OFF;
+    md_recv_clear_mode(MD_HEADER_REMOTE_READY_FOR_TEXT);
 }
 
-bool md_get_backlight() {
-  return backlight_val == BACKLIGHT_ON;
+void md_set_backlight(bool isOn) {
+  _md_cmd_set(CMD_BACKLIGHT, isOn ? BACKLIGHT_ON : BACKLIGHT_OFF);
 }
 
-static void _md_set_backlight_raw(uint8_t *data) {
-  backlight_val = data[REG_BACKLIGHT];
+bool md_get_backlight() {
+  return _proto.backlight_val == BACKLIGHT_ON;
 }
 
 
-void _md_set_rec_mode_raw(uint8_t *data) {
-  rec_indicator_val = data[REG_RECORDING_INDICATOR];
-}
-
 bool md_get_recording_enabled() {
-  return rec_indicator_val == RECORDING_INDICATOR_ENABLED;
+  return _proto.rec_indicator_val == RECORDING_INDICATOR_ENABLED;
 }
 
 void md_set_recording_enabled(bool is_enabled) {
-  if (is_enabled)
-    rec_indicator_val = RECORDING_INDICATOR_ENABLED;
-  else
-    rec_indicator_val = 0;
+  _md_cmd_set(CMD_REC_MODE, is_enabled ? RECORDING_INDICATOR_ENABLED : 0);
 }
 
 void md_send_recording_indicator() {
-  uint8_t *send_buf = md_get_send_buf();
-  send_buf[0] = CMD_REC_MODE;
-  send_buf[REG_RECORDING_INDICATOR] = rec_indicator_val;
-  md_send_packet(send_buf, 10);
+  _md_cmd_send(CMD_REC_MODE);
 }
 
 
-void _md_set_eq_raw(uint8_t *data) {
-  eq_val = data[REG_RECORDING_INDICATOR];
-}
-
 uint8_t md_get_eq() {
-  return eq_val;
+  return _proto.eq_val;
 }
 
 void md_set_eq(uint8_t eq) {
-  eq_val =  eq;
+  _md_cmd_set(CMD_EQ, eq);
 }
 
 void md_send_eq() {
-  uint8_t *send_buf = md_get_send_buf();
-  send_buf[0] = CMD_EQ;
-  send_buf[REG_EQ] = eq_val;
-  md_send_packet(send_buf, 10);
+  _md_cmd_send(CMD_EQ);
 }
 
 void md_send_backlight() {
-  uint8_t *send_buf = md_get_send_buf();
-  send_buf[0] = CMD_BACKLIGHT;
-  send_buf[REG_BACKLIGHT] = backlight_val;
-  md_send_packet(send_buf, 10);
+  _md_cmd_send(CMD_BACKLIGHT);
 }
 
 
-void _md_set_alarm_raw(uint8_t *data) {
-  alarm_val = data[REG_ALARM_INDICATOR];
-}
-
 bool md_get_alarm_enabled() {
-  return alarm_val == ALARM_INDICATOR_ENABLED;
+  return _proto.alarm_val == ALARM_INDICATOR_ENABLED;
 }
 
 void md_set_alarm_enabled(bool is_enabled) {
-  if (is_enabled)
-    alarm_val = ALARM_INDICATOR_ENABLED;
-  else
-    alarm_val = 0;
+  _md_cmd_set(CMD_ALARM, is_enabled ? ALARM_INDICATOR_ENABLED : 0);
 }
 
 void md_send_alarm_indicator() {
-  uint8_t *send_buf = md_get_send_buf();
-  send_buf[0] = CMD_ALARM;
-  send_buf[REG_ALARM_INDICATOR] = alarm_val;
-  md_send_packet(send_buf, 10);
+  _md_cmd_send(CMD_ALARM);
 }
 
 void md_set_volume(uint8_t volume) {
-  volume_val = volume;
+  _md_cmd_set(CMD_VOLUME, volume);
 }
 
 uint8_t md_get_volume() {
-  return volume_val;
+  return _proto.volume_val;
 }
 
-void _md_set_volume_raw(uint8_t *data) {
-  volume_val = data[REG_VOLUME];
-}
-
-       
 bool md_get_play_mode_repeat() {
-  return play_mode_val == PLAY_MODE_REPEAT;
+  return _proto.play_mode_val == PLAY_MODE_REPEAT;
 }
 
 bool md_get_play_mode_repeat_one() {
-  return play_mode_val == PLAY_MODE_REPEAT_ONE;
+  return _proto.play_mode_val == PLAY_MODE_REPEAT_ONE;
 }
 
 bool md_get_play_mode_shuffle() {
-  return play_mode_val == PLAY_MODE_SHUFFLE;
+  return _proto.play_mode_val == PLAY_MODE_SHUFFLE;
 }
 
-void _md_set_play_mode_raw(uint8_t *data) {
-  play_mode_val = data[REG_PLAY_MODE];
-}
 
 bool md_battery_is_charging() {
-  return battery_val == BATTERY_CHARGE;
+  return _proto.battery_val == BATTERY_CHARGE;
 }
 
 bool md_battery_is_low() {
-  return battery_val == BATTERY_LOW;
+  return _proto.battery_val == BATTERY_LOW;
 }
 
 uint8_t get_battery_level() {
-  if (battery_val == BATTERY_CHARGE)
+  if (_proto.battery_val == BATTERY_CHARGE)
     return 0;
-  else if (battery_val == BATTERY_LOW)
+  else if (_proto.battery_val == BATTERY_LOW)
     return 0;
-  else if (battery_val == BATTERY_ZERO)
+  else if (_proto.battery_val == BATTERY_ZERO)
     return 0;
   else {
-    uint8_t chg = battery_val >> 5;
+    uint8_t chg = _proto.battery_val >> 5;
     chg &= 0xFB;
     return chg + 1;
   }
 }
             
-void _md_set_battery_raw(uint8_t *data) {
-  battery_val = data[REG_BATTERY];  
-}
 
 int md_get_track() {
-  return ((track_val >> 4) * 10) + (track_val & 0xF);
+  return ((_proto.track_val >> 4) * 10) + (_proto.track_val & 0xF);
 }
 
 void md_set_track(uint8_t track) {
-  track_val = ((track / 10) << 4) | track % 10;
+  _md_cmd_set(CMD_TRACK, ((track / 10) << 4) | track % 10);
   //_md_reset_text();
 }
 
 void md_send_track() {
-  uint8_t *send_buf = md_get_send_buf();
-  send_buf[0] = CMD_TRACK;
-  send_buf[REG_TRACK] = track_val;
-  md_send_packet(send_buf, 10);
+  _md_cmd_send(CMD_TRACK);
 }
 
 static void _md_set_track_raw(uint8_t *data) {
   uint8_t reg = data[REG_TRACK];
-  if (track_val != reg) {
+  if (_proto.track_val != reg) {
     // track changed
     _md_reset_text();
+    // tell everyone now, so the track comes before its title
+    _md_cmd_update(_md_cmd_find(CMD_TRACK), reg);
+#if MD_TITLE_CACHE_ENTRIES
+    // been here before, show it now. The player sends it again anyway,
+    // that just checks it
+    _proto.title_hit = _md_title_find(reg);
+    if (_proto.title_hit)
+      _md_text_done(_proto.title_hit->title, strlen(_proto.title_hit->title), false);
+#endif
   }
-  track_val = reg;
 }
 
 uint8_t md_get_play_state() {
-  return play_state_val;
+  return _proto.play_state_val;
 }
 
-void _md_set_play_state_raw(uint8_t *data) {
-  play_state_val = data[REG_PLAY_STATE];
-}
 
 void md_disp_send_mode() {
-  uint8_t *send_buf = md_get_send_buf();
-  send_buf[0] = CMD_DISP_MODE_MAYBE;
-  send_buf[1] = 0x80;
-  send_buf[2] = 0x03;
-  md_send_packet(send_buf, 10);
+  _md_cmd_send(CMD_DISP_MODE_MAYBE);
 }
 
-void _md_set_disp_raw(uint8_t *data) {
+static void _md_disp_mode_encode(uint8_t *buf) {
+  buf[1] = 0x80;
+  buf[2] = 0x03;
+}
+
+static void _md_set_disp_raw(uint8_t *data) {
   //_md_reset_text();
 }
 
@@ -502,7 +729,7 @@ void md_recv_mode_timer() {
 }
 
 bool md_is_text_sending() {
-  return _send_text;
+  return _proto.send_text;
 }
 
 void md_display() {
@@ -533,21 +760,33 @@ void md_setup() {
 #if MD_ENABLE_SEND
   md_send_setup();
 #endif
+#if MD_ENABLE_TELEMETRY
+  md_telem_setup();
+#endif
 md_recv_set_mode(MD_HEADER_REMOTE_READY_FOR_TEXT);
 }
 
 void md_loop() {
 #if MD_ENABLE_RECV
-  if (_recv_enabled)
+  if (_proto.recv_enabled)
     md_recv_loop();
 #endif
   // todo
   // deal with text here
   // if send text flag set
-  if(_send_text && md_send_is_ready_for_text()) {
+  // one chunk at a time, the next when the remote asks for it
+  if(_proto.send_text && _md_text_tx_ready() && !md_send_is_queued(CMD_TEXT) && md_send_is_ready_for_text()) {
     _md_send_text();
   }
 #if MD_ENABLE_SEND
+  // the rest of a md_sync_device() that didn't fit in the queue
+  if (_proto.sync)
+    _md_sync_drain();
   md_send_loop();
+#endif
+  // clear of the bus now, print what happened
+  md_log_drain();
+#if MD_ENABLE_TELEMETRY
+  md_telem_loop();
 #endif
 }
@@ -0,0 +1,217 @@
+/*
+ * Sony MD Remote proxy
+ * Barry Carter 2022 <barry.carter@gmail.com>
+ *
+ * Sit in the middle of a real player and a real remote. We are the remote
+ * to the player on one bus, and the player to the remote on another, and
+ * pass the frames across as soon as the other side's bus is free.
+ *
+ * Player frames go to the remote, the remote's header bits and button
+ * packets go back up to the player. md_proxy_rewrite_cb() sees every frame
+ * on the way through, so text, track etc. can be changed in flight, and
+ * md_proxy_inject() adds frames of our own.
+ *
+ * md_send_packet() blocks unless MD_SEND_ASYNC is set, so use that or
+ * MD_RECV_USE_ISR, or the player's frames are missed while sending.
+ *
+ * md_bus_t remote_bus;
+ * md_proxy_t proxy;
+ *
+ * void setup() {
+ *   md_bus_init(&remote_bus, 5, 6);
+ *   md_proxy_setup(&proxy, &md_bus_default, &remote_bus);
+ * }
+ *
+ * void loop() {
+ *   md_proxy_loop(&proxy);
+ * }
+ */
+#include "sony_md_remote.h"
+#if MD_ENABLE_PROXY && MD_ENABLE_RECV && MD_ENABLE_SEND
+
+// the header bits the player gets to see straight from the remote.
+// TX_READY is ours, it's set when we have a packet of the remote's to hand on
+#define _MD_PROXY_HEADER_MASK (0xFF & ~(1 << MD_HEADER_REMOTE_TX_READY))
+
+// text chunks all need to go, in order. Capabilities are one block each
+static bool _md_proxy_coalesces(uint8_t cmd) {
+  return cmd != CMD_TEXT && cmd != CMD_CAPABILITIES;
+}
+
+static void _md_proxy_count_delay(md_proxy_t *proxy, unsigned long delay_us) {
+  md_proxy_stats_t *stats = &proxy->stats;
+  stats->to_remote++;
+  if (stats->to_remote == 1 || delay_us < stats->delay_us_min)
+    stats->delay_us_min = delay_us;
+  if (delay_us > stats->delay_us_max)
+    stats->delay_us_max = delay_us;
+  if (delay_us > MD_PROXY_MAX_DELAY_US)
+    stats->late++;
+  proxy->delay_total += delay_us;
+  stats->delay_us_avg = proxy->delay_total / stats->to_remote;
+
+  uint8_t bucket = 0;
+  while (bucket < MD_PROXY_STATS_HIST_LEN - 1 && delay_us >= (1UL << bucket))
+    bucket++;
+  stats->delay_us_hist[bucket]++;
+}
+
+// let the app have a look. @returns false if it's to be dropped
+static bool _md_proxy_rewrite(md_proxy_t *proxy, uint8_t dir, uint8_t *data, uint8_t len) {
+  uint8_t orig[10];
+  memcpy(orig, data, len);
+  if (!md_proxy_rewrite_cb(dir, data, len)) {
+    proxy->stats.dropped++;
+    return false;
+  }
+  if (memcmp(orig, data, len))
+    proxy->stats.rewritten++;
+  return true;
+}
+
+static bool _md_proxy_queue(md_proxy_t *proxy, uint8_t *data, uint8_t len, unsigned long stamp) {
+  if (len > 10)
+    return false;
+
+  // an update for something still waiting. It keeps its place, and its
+  // stamp, the remote has been out of date since then
+  if (_md_proxy_coalesces(data[0])) {
+    for (uint8_t i = 0; i < proxy->queue_len; i++) {
+      if (proxy->queue[i].data[0] != data[0])
+        continue;
+      memcpy(proxy->queue[i].data, data, len);
+      proxy->queue[i].len = len;
+      proxy->stats.coalesced++;
+      return true;
+    }
+  }
+
+  if (proxy->queue_len >= MD_PROXY_QUEUE_LEN) {
+    proxy->stats.overflows++;
+    return false;
+  }
+  md_frame_t *frame = &proxy->queue[proxy->queue_len++];
+  frame->stamp = stamp;
+  frame->len = len;
+  memcpy(frame->data, data, len);
+  return true;
+}
+
+// what the remote says about itself, the player sees as ours
+static void _md_proxy_set_header(md_proxy_t *proxy, uint8_t header) {
+  proxy->header = header;
+  for (uint8_t bit = 0; bit < 8; bit++) {
+    if (!(_MD_PROXY_HEADER_MASK & (1 << bit)))
+      continue;
+    if (header & (1 << bit))
+      md_recv_set_mode(bit);
+    else
+      md_recv_clear_mode(bit);
+  }
+}
+
+// on the remote's bus. Send the oldest waiting frame if it's free
+static void _md_proxy_to_remote(md_proxy_t *proxy) {
+  if (!proxy->queue_len || md_send_is_busy())
+    return;
+
+  // the remote has a button press for us, that goes first
+  if (md_send_get_cmd() & (1 << MD_HEADER_REMOTE_TX_READY)) {
+    _do_send_recv();
+    return;
+  }
+
+  md_frame_t *frame = &proxy->queue[0];
+  _md_proxy_count_delay(proxy, micros() - frame->stamp);
+  md_send_packet(frame->data, frame->len);
+
+  proxy->queue_len--;
+  memmove(&proxy->queue[0], &proxy->queue[1], proxy->queue_len * sizeof(proxy->queue[0]));
+}
+
+void _md_proxy_from_player(uint8_t *data, unsigned long stamp) {
+  md_proxy_t *proxy = _md_bus->proxy;
+  uint8_t buf[10];
+  memcpy(buf, data, sizeof(buf));
+  if (!_md_proxy_rewrite(proxy, MD_PROXY_TO_REMOTE, buf, sizeof(buf)))
+    return;
+  _md_proxy_queue(proxy, buf, sizeof(buf), stamp);
+}
+
+void _md_proxy_from_remote(uint8_t *data, uint8_t len, bool parity_ok) {
+  md_proxy_t *proxy = _md_bus->proxy;
+  uint8_t buf[10];
+  if (!parity_ok || len > sizeof(buf)) {
+    proxy->stats.dropped++;
+    return;
+  }
+  memcpy(buf, data, len);
+  if (!_md_proxy_rewrite(proxy, MD_PROXY_TO_PLAYER, buf, len))
+    return;
+
+  md_bus_t *prev = _md_bus;
+  md_bus_select(proxy->player);
+  // the player hasn't given us the bus for the last one yet. The newest wins
+  if (_md_bus->recv.send_len)
+    proxy->stats.overflows++;
+  memcpy(md_recv_get_send_buf(), buf, len);
+  md_recv_set_send_len(len);
+  proxy->stats.to_player++;
+  md_bus_select(prev);
+}
+
+void md_proxy_setup(md_proxy_t *proxy, md_bus_t *player, md_bus_t *remote) {
+  md_bus_t *prev = _md_bus;
+  memset(proxy, 0, sizeof(*proxy));
+  proxy->player = player;
+  proxy->remote = remote;
+  player->proxy = proxy;
+  remote->proxy = proxy;
+
+  md_bus_select(remote);
+  md_send_setup();
+  md_bus_select(player);
+  md_recv_setup();
+  // nothing heard from the remote yet, so don't tell the player it's there
+  _md_proxy_set_header(proxy, 0);
+  md_bus_select(prev);
+}
+
+void md_proxy_loop(md_proxy_t *proxy) {
+  md_bus_t *prev = _md_bus;
+
+  // frames from the player end up in _md_proxy_from_player()
+  md_bus_select(proxy->player);
+  md_recv_loop();
+
+  // and go straight out, unless the remote is still busy with the last one.
+  // md_send_loop() keeps the remote polled and reads its packets
+  md_bus_select(proxy->remote);
+  _md_proxy_to_remote(proxy);
+  md_send_loop();
+  uint8_t header = md_send_get_cmd() & _MD_PROXY_HEADER_MASK;
+
+  md_bus_select(proxy->player);
+  if (header != proxy->header) {
+    proxy->stats.headers++;
+    _md_proxy_set_header(proxy, header);
+  }
+  md_bus_select(prev);
+  md_log_drain();
+}
+
+bool md_proxy_inject(md_proxy_t *proxy, uint8_t *data, uint8_t len) {
+  return _md_proxy_queue(proxy, data, len, micros());
+}
+
+void md_proxy_get_stats(md_proxy_t *proxy, md_proxy_stats_t *stats) {
+  *stats = proxy->stats;
+}
+
+void md_proxy_reset_stats(md_proxy_t *proxy) {
+  memset(&proxy->stats, 0, sizeof(proxy->stats));
+  proxy->delay_total = 0;
+}
+
+bool __attribute__((weak)) md_proxy_rewrite_cb(uint8_t, uint8_t *, uint8_t) { return true; }
+#endif
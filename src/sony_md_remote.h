@@ -9,18 +9,50 @@
 
 
 // SETUP
+// Everything in SETUP and DEBUG can be overridden from the build flags
 // Pin to READ from
+#ifndef MD_DATA_PIN
 #define MD_DATA_PIN      3
+#endif
 
 // pin to WRITE to
+#ifndef MD_SEND_DATA_PIN
 #define MD_SEND_DATA_PIN 4
+#endif
 
 // serial port, I use USB.
+#ifndef MD_SERIAL_PORT
 #define MD_SERIAL_PORT   Serial
+#endif
 
 // save space by disabling certain features
+#ifndef MD_ENABLE_RECV
 #define MD_ENABLE_RECV   1
+#endif
+#ifndef MD_ENABLE_SEND
 #define MD_ENABLE_SEND   1
+#endif
+
+// Receive with a pin change interrupt instead of busy polling the data pin.
+// Each edge is timestamped and decoded in the ISR, md_recv_loop() then only
+// parses the finished packets, so it returns straight away.
+#ifndef MD_RECV_USE_ISR
+#define MD_RECV_USE_ISR  0
+#endif
+
+// Let go of the line after a header write back from a one shot timer,
+// rather than sitting in delayMicroseconds() and missing the edges
+#ifndef MD_RECV_WB_TIMER
+#define MD_RECV_WB_TIMER 1
+#endif
+
+// md_send_packet() compiles the packet into a table of pulses and plays it
+// out from a timer interrupt, returning straight away. md_send_done_cb()
+// is called from the next md_send_loop() once it has gone, not from the
+// interrupt. Otherwise it blocks until it's sent
+#ifndef MD_SEND_ASYNC
+#define MD_SEND_ASYNC    0
+#endif
 
 // TUNING
 
@@ -32,8 +64,33 @@
 #define PULSE_WIDTH_ON_US_MIN 100
 
 // Timeout for how long before we consider the packet done.
+// Also how long we wait for the line to move before giving up on it
 #define END_MSG_TIMEOUT_US 6500
 
+// The most time (us) one md_recv_loop() call spends polling the pin.
+// Long enough for a whole frame, it returns sooner once one is done
+#define MD_RECV_POLL_BUDGET_US 30000
+
+// The three above are only the starting point if calibration is enabled,
+// and md_recv_calibrate() has been called. It histograms the low pulse
+// widths and moves the thresholds into the gaps between the 1s, the 0s and
+// the resets, never letting a reset outside RESET_LOW_US_MIN-MAX. Costs a
+// couple of bytes per bucket, off unless you ask for it.
+#ifndef MD_RECV_CALIBRATE
+#define MD_RECV_CALIBRATE  0
+#endif
+// histogram bucket width, and how many. Longer pulses land in the last one
+#define MD_RECV_CALIB_BUCKET_US  8
+#define MD_RECV_CALIB_BUCKETS    192
+// how many low pulses to look at before picking new thresholds
+#define MD_RECV_CALIB_SAMPLES    2048
+
+// header + 10 byte payload + parity
+#define MD_RECV_FRAME_LEN  13
+
+// How many decoded frames can queue up waiting for md_recv_loop(). Power of 2
+#define MD_RECV_RING_LEN   8
+
 // Header RW bits for the remote emulation
 #define MD_HEADER_REMOTE_READY_FOR_TEXT   1
 #define MD_HEADER_REMOTE_TIMER            2
@@ -61,11 +118,115 @@
 // When SENDING, how long between bytes.
 #define MD_INTER_BYTE_DELAY     80
 
+// Those are the stock timings. md_send_set_timing() changes them at
+// runtime, and md_send_calibrate() finds the shortest your remote will take.
+// Set MD_SEND_TIMING_EEPROM to keep that in the EEPROM at
+// MD_SEND_TIMING_EEPROM_ADDR, and load it again at setup. Off by default,
+// so the library leaves your EEPROM alone
+#ifndef MD_SEND_TIMING_EEPROM
+#define MD_SEND_TIMING_EEPROM   0
+#endif
+#ifndef MD_SEND_TIMING_EEPROM_ADDR
+#define MD_SEND_TIMING_EEPROM_ADDR 0
+#endif
+// how many capability reads each setting has to get right
+#define MD_SEND_CALIB_PROBES    4
+// and how many polls the remote gets to answer each one
+#define MD_SEND_CALIB_POLLS     8
+// stop bisecting when it's this close (us)
+#define MD_SEND_CALIB_STEP_US   2
+
+// How many steps a compiled packet can have. A full packet needs 221,
+// reading one from the remote 288
+#ifndef MD_SEND_WAVE_LEN
+#define MD_SEND_WAVE_LEN        288
+#endif
+
+// The md_send_* state calls queue their frames, and md_send_loop() sends
+// them one per slot. Updates to the same command while one is waiting just
+// replace it, so 5 volume changes in a row only go out once
+#define MD_SEND_QUEUE_LEN       8
+// how often (us) md_send_loop() can send a queued frame
+#define MD_SEND_SLOT_US         8000
+// How long (us) the bus can be quiet before a NOP polls the remote. It
+// drops to the min as soon as the remote says it has something to send or
+// wants text, then doubles back up to the max while it stays quiet
+#ifndef MD_SEND_POLL_MIN_US
+#define MD_SEND_POLL_MIN_US     8000
+#endif
+#ifndef MD_SEND_POLL_MAX_US
+#define MD_SEND_POLL_MAX_US     32000
+#endif
+
+// queue priorities. Higher goes first, oldest first within one
+#define MD_SEND_PRIO_LOW        0   // indicators, backlight, eq
+#define MD_SEND_PRIO_NORMAL     1   // track, play state, volume
+#define MD_SEND_PRIO_HIGH       2   // text and capabilities
+
+// PROXY
+// Sit between a real player and a real remote on two buses, passing frames
+// both ways. See sony_md_proxy.cpp. Needs both RECV and SEND
+#ifndef MD_ENABLE_PROXY
+#define MD_ENABLE_PROXY         1
+#endif
+// frames from the player waiting for the remote's bus. A newer frame for
+// the same command replaces one still waiting, text always goes in order
+#define MD_PROXY_QUEUE_LEN      4
+// frames that wait longer than this (us) before going to the remote are counted as late
+#define MD_PROXY_MAX_DELAY_US   10000
+
+#define MD_PROXY_TO_REMOTE      0
+#define MD_PROXY_TO_PLAYER      1
+
 // DEBUG
 // Dump the raw packet to the USB
+#ifndef DUMP_MD_PACKET
 #define DUMP_MD_PACKET          1
+#endif
+
+// Logging. Anything above MD_LOG_LEVEL isn't compiled in at all. Records go
+// into a ring as they happen, md_log_drain() hands them to the sink later,
+// from md_loop(), well away from the bus timing. Nothing is allocated
+#define MD_LOG_NONE             0
+#define MD_LOG_ERROR            1
+#define MD_LOG_WARN             2
+#define MD_LOG_INFO             3
+#define MD_LOG_DEBUG            4   // every packet
+#ifndef MD_LOG_LEVEL
+#if DUMP_MD_PACKET
+#define MD_LOG_LEVEL            MD_LOG_DEBUG
+#else
+#define MD_LOG_LEVEL            MD_LOG_WARN
+#endif
+#endif
+// records waiting for md_log_drain(). Power of 2
+#define MD_LOG_RING_LEN         16
+
+// what a log record is about, and what is in its data
+#define MD_LOG_TAG_RECV_FRAME   0   // a frame from the player, header and parity included
+#define MD_LOG_TAG_RECV_PARITY  1   // the parity it came with, and what it should have been
+#define MD_LOG_TAG_RECV_RESET   2   // bits we had when a reset cut a byte short
+#define MD_LOG_TAG_SEND_FRAME   3   // a packet we sent, then the header the remote answered with
+#define MD_LOG_TAG_REMOTE_FRAME 4   // a packet from the remote, then 1 if its parity was good
+#define MD_LOG_TAG_SEND_WAVE    5   // a packet that didn't fit in MD_SEND_WAVE_LEN, so never went
+#define MD_LOG_TAG_JT_TEXT      6   // the text in each page md_jt_send_text() sends
 // verify the bit parity. Disabling can save a few cycles if you are short
+#ifndef MD_CALC_RECV_PARITY
 #define MD_CALC_RECV_PARITY     1
+#endif
+
+// TELEMETRY
+// Send binary records (see sony_md_telemetry.h) rather than text. It takes
+// over the log sink, and sends state changes and counters as well.
+// tools/md_telemetry_recv.cpp reads it back
+#ifndef MD_ENABLE_TELEMETRY
+#define MD_ENABLE_TELEMETRY     0
+#endif
+#ifndef MD_TELEM_PORT
+#define MD_TELEM_PORT           MD_SERIAL_PORT
+#endif
+// how often (ms) the counters go
+#define MD_TELEM_COUNTERS_MS    1000
 
 // COMMANDS
 // the first byte after the address is the command
@@ -98,8 +259,20 @@
 #define REG_TEXT_POSITION       0x03
 #define REG_TEXT_LEN            0x07
 
-// how big is the text buffer. Your device might not have as much ram as mine...
-#define MAX_TEXT_LEN            64
+// how big is the text buffer, in 7 char pages. Your device might not have as
+// much ram as mine... Longer text still works, but has to be streamed with
+// md_text_write() / md_text_read() as it goes. Otherwise it's cut short, see
+// md_text_truncated()
+#ifndef MD_TEXT_POOL_PAGES
+#define MD_TEXT_POOL_PAGES      10
+#endif
+
+// Titles for the last few tracks, so they show straight away when going
+// back to one. Costs entries * len bytes. 0 entries turns it off
+#ifndef MD_TITLE_CACHE_ENTRIES
+#define MD_TITLE_CACHE_ENTRIES  4
+#endif
+#define MD_TITLE_CACHE_LEN      64
 
 #define CMD_TEXT_APPEND         0x02
 #define CMD_TEXT_END            0x01
@@ -185,6 +358,166 @@ battery bar count is in bit 5 and 6
 #define REG_ALARM_INDICATOR     0x01
 #define ALARM_INDICATOR_ENABLED 0x7F
 
+// Events, for md_event_subscribe(). One for each thing the player tells us
+#define MD_EVENT_BACKLIGHT      0
+#define MD_EVENT_VOLUME         1
+#define MD_EVENT_PLAY_MODE      2
+#define MD_EVENT_REC_INDICATOR  3
+#define MD_EVENT_BATTERY        4
+#define MD_EVENT_EQ             5
+#define MD_EVENT_ALARM          6
+#define MD_EVENT_TRACK          7
+#define MD_EVENT_PLAY_STATE     8
+#define MD_EVENT_TEXT           9
+#define MD_EVENT_NONE           0xFF
+#define MD_EVENT_MASK(event)    (1 << (event))
+#define MD_EVENT_ALL            0xFFFF
+
+// how many listeners each bus can have
+#ifndef MD_EVENT_LISTENERS
+#define MD_EVENT_LISTENERS      4
+#endif
+
+// A value the player changed. Repeats of the same value don't make one
+typedef struct md_event_t {
+  uint8_t type;                   // MD_EVENT_*
+  uint8_t value;                  // the new register value
+  uint8_t prev;                   // what it was before, the same as value the first time
+  const char *text;               // MD_EVENT_TEXT only, the whole text
+  uint16_t text_len;
+  bool text_truncated;            // MD_EVENT_TEXT, there was more than MD_TEXT_POOL_PAGES held
+} md_event_t;
+
+typedef void (*md_event_cb_t)(const md_event_t *event, void *ctx);
+
+// Frame status, returned when a frame completes
+#define MD_FRAME_NONE           0
+#define MD_FRAME_OK             1
+#define MD_FRAME_NOP            2
+#define MD_FRAME_NOT_READY      3
+#define MD_FRAME_BUS_AVAIL      4
+#define MD_FRAME_TRUNCATED      5
+#define MD_FRAME_BAD_PARITY     6
+
+// A decoded frame, as queued between the receiver and md_recv_loop()
+typedef struct md_frame_t {
+  unsigned long stamp;            // micros() at the end of the frame
+  uint8_t len;
+  uint8_t data[MD_RECV_FRAME_LEN];
+} md_frame_t;
+
+// Receiver health. Read with md_recv_get_stats(), clear with md_recv_reset_stats()
+#define MD_RECV_STATS_HIST_LEN  16
+typedef struct md_recv_stats_t {
+  uint32_t frames;                // good frames, parsed
+  uint32_t nops;                  // header only syncs
+  uint32_t not_ready;             // host ready bit missing from the header
+  uint32_t bus_avail;             // the host handing us the bus
+  uint32_t truncated;             // stopped before all 13 bytes arrived
+  uint32_t parity_errors;
+  uint32_t resets_mid_byte;       // a reset turned up part way through a byte
+  uint32_t line_timeouts;         // the line stopped moving part way through a byte
+  // time (us) md_recv_loop() spends on each frame, callbacks included
+  uint32_t parse_us_min;
+  uint32_t parse_us_avg;
+  uint32_t parse_us_max;
+  // and how those are spread. Bucket n counts frames taking under 2^n us
+  uint32_t parse_us_hist[MD_RECV_STATS_HIST_LEN];
+  // header bits written back to the host, and how far (us) each one was
+  // from MD_PULSE_LONG_US. Positive is late letting go
+  uint32_t write_backs;
+  int32_t wb_jitter_us_min;
+  int32_t wb_jitter_us_avg;
+  int32_t wb_jitter_us_max;
+} md_recv_stats_t;
+
+// Receive thresholds currently in use
+typedef struct md_recv_thresholds_t {
+  uint16_t pulse_on_us_min;       // low pulses shorter than this are a 1
+  uint16_t reset_low_us_min;      // low pulses between these two are a reset
+  uint16_t reset_low_us_max;
+  uint16_t margin_us;             // how close the nearest seen pulse came to a threshold
+  uint32_t samples;               // pulses they came from, 0 for the compiled in defaults
+} md_recv_thresholds_t;
+
+// Receive ring counters
+typedef struct md_recv_ring_stats_t {
+  uint32_t queued;                // frames put in the ring
+  uint32_t parsed;                // frames taken out by md_recv_loop()
+  uint32_t dropped;               // frames lost because the ring was full
+  uint8_t max_depth;              // most frames ever waiting at once
+} md_recv_ring_stats_t;
+
+// Sender timing, all in us
+typedef struct md_send_timing_t {
+  uint16_t pulse_short_us;
+  uint16_t pulse_long_us;
+  uint16_t reset_low_us;
+  uint16_t reset_high_us;
+  uint16_t byte_gap_us;           // after the header, parity and md_send_byte()
+  uint16_t data_gap_us;           // after each data byte. Has always been 2x byte_gap_us
+} md_send_timing_t;
+
+// Transmit queue counters
+typedef struct md_send_queue_stats_t {
+  uint32_t queued;                // frames put in the queue
+  uint32_t coalesced;             // frames that replaced one already waiting
+  uint32_t sent;
+  uint32_t dropped;               // frames lost because the queue was full
+  uint8_t max_depth;              // most frames ever waiting at once
+} md_send_queue_stats_t;
+
+// Host side polling. Read with md_send_get_poll_stats()
+typedef struct md_send_poll_stats_t {
+  uint32_t polls;                 // NOPs sent
+  uint32_t polls_per_sec;         // since the stats were last reset
+  uint32_t interval_us;           // how long until the next NOP right now
+  // how long the remote could have been waiting for us to notice it wants
+  // the bus, i.e. from the last header without TX_READY to the one with it
+  uint32_t remote_waits;
+  uint32_t latency_us_min;
+  uint32_t latency_us_avg;
+  uint32_t latency_us_max;
+  // packets read from the remote, and how many of those failed parity
+  uint32_t reads;
+  uint32_t read_parity_errors;
+} md_send_poll_stats_t;
+
+// Proxy counters. Read with md_proxy_get_stats()
+#define MD_PROXY_STATS_HIST_LEN 16
+typedef struct md_proxy_stats_t {
+  uint32_t to_remote;             // player frames sent on to the remote
+  uint32_t to_player;             // remote packets handed back up to the player
+  uint32_t rewritten;             // frames md_proxy_rewrite_cb() changed
+  uint32_t dropped;               // frames it threw away, or that failed parity
+  uint32_t coalesced;             // frames replaced by a newer one before they went
+  uint32_t overflows;             // frames lost because the queue was full
+  uint32_t headers;               // times the remote's header bits changed
+  // how long (us) from the end of the player's frame to it starting out to the remote
+  uint32_t late;                  // more than MD_PROXY_MAX_DELAY_US
+  uint32_t delay_us_min;
+  uint32_t delay_us_avg;
+  uint32_t delay_us_max;
+  // bucket n counts frames taking under 2^n us
+  uint32_t delay_us_hist[MD_PROXY_STATS_HIST_LEN];
+} md_proxy_stats_t;
+
+// One thing that happened, as it goes through the log ring
+typedef struct md_log_record_t {
+  uint32_t stamp;                 // micros()
+  uint8_t level;                  // MD_LOG_*
+  uint8_t tag;                    // MD_LOG_TAG_*
+  uint8_t bus;                    // the bus id it happened on
+  uint8_t len;                    // how much of data is used
+  uint8_t data[MD_RECV_FRAME_LEN];
+} md_log_record_t;
+
+typedef void (*md_log_sink_t)(const md_log_record_t *rec);
+
+#include "sony_md_bus.h"
+#include "sony_md_telemetry.h"
+#include "sony_md_capture.h"
+
 // Function defs
 
 void md_setup();
@@ -198,8 +531,22 @@ void md_recv_enable(bool is_enabled);
 
 // @returns complete status. False is not completed sending
 bool md_send_text();
-void md_set_text(char *newtext);
+// @returns how much of it will go. The ring holds MD_TEXT_POOL_PAGES * 7 - 1
+// chars, anything longer needs md_text_write()
+uint16_t md_set_text(char *newtext);
 char *md_get_text();
+// the last text from the player didn't fit in the ring, so md_get_text() and
+// md_text_received_cb() only have the start of it
+bool md_text_truncated();
+// Stream text to the remote a bit at a time. @returns how much there was room for,
+// more frees up as it's sent. Call md_text_write_end() after the last of it
+uint16_t md_text_write(const char *src, uint16_t len);
+void md_text_write_end();
+// Take text from the player as it arrives, whole chunks at a time. Once this
+// has been called the player is held off while there's no room, rather than
+// the text being cut short. md_text_received_cb() then only gets what
+// hadn't been read yet. @returns how much was copied
+uint16_t md_text_read(char *buf, uint16_t len);
 
 bool md_get_backlight();
 void md_set_backlight(bool isOn);
@@ -238,35 +585,141 @@ bool _md_send_text();
 
 void md_request_capabilities(uint8_t block);
 
-// sync without waiting for the next send window. just send now
+// Be told when the player changes something. mask is MD_EVENT_MASK()s or'd
+// together, or MD_EVENT_ALL. Called from md_loop(), for the current bus.
+// @returns a handle for md_event_unsubscribe(), or -1 if the table is full
+int8_t md_event_subscribe(uint16_t mask, md_event_cb_t cb, void *ctx);
+void md_event_unsubscribe(int8_t handle);
+
+// queue a frame for everything changed through the setters since it was last sent.
+// What doesn't fit in the queue now goes from md_loop() as it empties
 void md_sync_device();
+// send everything again, e.g. after the remote was plugged back in
+void md_resync_device();
 
 // recv
 void md_recv_setup();
 void md_recv_loop();
+// feed the decoder a single edge, e.g. from a recorded trace.
+// level is the new line level, duration is how long (us) the old level lasted
+// @returns MD_FRAME_NONE until a frame completes, then what we made of it
+int8_t md_recv_edge(uint8_t level, unsigned long duration);
+// the last parsed frame, header and parity included
+uint8_t *md_recv_get_frame(uint8_t *len);
+void md_recv_get_ring_stats(md_recv_ring_stats_t *stats);
+void md_recv_get_stats(md_recv_stats_t *stats);
+void md_recv_reset_stats();
+// start collecting pulse widths. Once there are MD_RECV_CALIB_SAMPLES, the
+// thresholds are moved. If continuous it then starts collecting again.
+// Needs MD_RECV_CALIBRATE, e.g. call it after md_setup() to learn them at startup
+void md_recv_calibrate(bool continuous);
+bool md_recv_is_calibrating();
+void md_recv_get_thresholds(md_recv_thresholds_t *thresholds);
+void md_recv_set_thresholds(md_recv_thresholds_t *thresholds);
+// listen only. never write header bits or payloads back to the player
+void md_recv_set_passive(bool is_passive);
 uint8_t *md_recv_get_send_buf();
 void md_recv_set_send_len(uint8_t len);
 void md_recv_set_mode(uint8_t mode);
 void md_recv_clear_mode(uint8_t mode);
 uint8_t md_calculate_parity(uint8_t *data, uint8_t byte_count);
-void _poll_pin_change(int level);
+// @returns false if the line didn't change within timeout_us
+bool _poll_pin_change(int level, unsigned long timeout_us = END_MSG_TIMEOUT_US);
 
 // send
 void md_send_setup();
 void md_send_loop();
 uint8_t *md_get_send_buf();
 uint8_t md_send_packet(uint8_t *data, uint8_t len);
+// queue a frame for md_send_loop() to send. The priority comes from the command.
+// @returns false if the queue was full of more important frames
+bool md_send_queue(uint8_t *data, uint8_t len);
+// is a frame for this command still waiting
+bool md_send_is_queued(uint8_t cmd);
+// @returns how many frames can be queued without pushing any out
+uint8_t md_send_queue_space();
+void md_send_get_queue_stats(md_send_queue_stats_t *stats);
+
+void md_send_set_timing(const md_send_timing_t *timing);
+void md_send_get_timing(md_send_timing_t *timing);
+// Needs a remote attached, and blocks for a few seconds. save puts the
+// result in the EEPROM, if MD_SEND_TIMING_EEPROM is on.
+// @returns false if the remote didn't answer, and the timing is left as it was
+bool md_send_calibrate(bool save);
+#if MD_SEND_TIMING_EEPROM
+void md_send_save_timing();
+// @returns false if there is nothing saved
+bool md_send_load_timing();
+#endif
+void md_send_get_poll_stats(md_send_poll_stats_t *stats);
+void md_send_reset_poll_stats();
 bool md_send_is_ready_for_text();
 bool md_send_is_ready_for_timer();
 bool md_send_is_error();
-void md_send_data(uint8_t pin, uint8_t *data, uint8_t len, uint8_t wait_pulse);
+// @returns false if we gave up waiting for a pulse
+bool md_send_data(uint8_t pin, uint8_t *data, uint8_t len, uint8_t wait_pulse);
+// a packet is still being played out. Only ever true with MD_SEND_ASYNC
+bool md_send_is_busy();
+// read the remote's 10 byte packet, once its header said TX_READY and we
+// gave it the bus. Blocks until it's in. @returns true if the parity matched
+bool md_send_read_packet(uint8_t *buf);
 void _do_send_recv();
 uint8_t md_send_get_cmd();
 
 // callback from recv
 void md_text_received_cb(char *text, uint8_t len);
 void md_packet_just_received_cb(uint8_t *data);
-
+// callback from send, once a packet has gone. cmd is the remote's header byte.
+// Never called from an interrupt, with MD_SEND_ASYNC it's from md_send_loop()
+void md_send_done_cb(uint8_t cmd);
+// callback from send, with a packet the remote sent us (buttons etc.)
+void md_send_remote_packet_cb(uint8_t *data, uint8_t len, bool parity_ok);
+
+// proxy
+// forward between the player and remote buses. Sets up the receiver on one and the sender on the other
+void md_proxy_setup(md_proxy_t *proxy, md_bus_t *player, md_bus_t *remote);
+// call this instead of md_loop(), as often as you can
+void md_proxy_loop(md_proxy_t *proxy);
+// send a frame of our own to the remote, as if the player had. e.g. an overlay
+// @returns false if the queue was full
+bool md_proxy_inject(md_proxy_t *proxy, uint8_t *data, uint8_t len);
+void md_proxy_get_stats(md_proxy_t *proxy, md_proxy_stats_t *stats);
+void md_proxy_reset_stats(md_proxy_t *proxy);
+// callback, with each frame on its way through. dir is MD_PROXY_TO_REMOTE or
+// MD_PROXY_TO_PLAYER. Change it in place, @returns false to drop it
+bool md_proxy_rewrite_cb(uint8_t dir, uint8_t *data, uint8_t len);
+// from the receiver and sender, when their bus is part of a proxy
+void _md_proxy_from_player(uint8_t *data, unsigned long stamp);
+void _md_proxy_from_remote(uint8_t *data, uint8_t len, bool parity_ok);
+// from the sender, with a queued frame that has just gone
+void _md_cmd_sent(uint8_t *data);
+
+// log
+#define MD_LOG(level, tag, data, len) \
+  do { if ((level) <= MD_LOG_LEVEL) md_log_write(level, tag, data, len); } while (0)
+// put a record in the ring. Fine from an interrupt. Use MD_LOG() so it goes when not wanted
+void md_log_write(uint8_t level, uint8_t tag, const uint8_t *data, uint8_t len);
+// hand everything waiting over to the sink. md_loop() calls this
+void md_log_drain();
+// where drained records go. NULL just throws them away
+void md_log_set_sink(md_log_sink_t sink);
+// records lost because the ring was full
+uint32_t md_log_get_dropped();
+// sinks that write to MD_SERIAL_PORT. One line of hex per record (the default), or the raw record
+void md_log_sink_hex(const md_log_record_t *rec);
+void md_log_sink_binary(const md_log_record_t *rec);
+
+// telemetry
+// start sending records for the current bus. md_setup() does it when MD_ENABLE_TELEMETRY is on
+void md_telem_setup();
+// send the counters when they are due. md_loop() calls it
+void md_telem_loop();
+// send the receiver's counters now
+void md_telem_send_counters();
+// frame up a record and send it, payload is cut short at MD_TELEM_PAYLOAD_MAX
+void md_telem_send(uint8_t type, const uint8_t *payload, uint8_t len);
+// log records as telemetry, md_telem_setup() sets it
+void md_telem_log_sink(const md_log_record_t *rec);
 
 // joint text
 void md_jt_sync_device();
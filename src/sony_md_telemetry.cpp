@@ -0,0 +1,104 @@
+/*
+ * Sony MD Remote telemetry
+ * Barry Carter 2022 <barry.carter@gmail.com>
+ *
+ * Every frame, state change and the counters, as COBS framed binary
+ * records on MD_TELEM_PORT. A frame is ~20 bytes on the wire rather than
+ * a line of text, so they can all be sent at full rate.
+ *
+ * Frames come in through the log, so MD_LOG_LEVEL needs to be MD_LOG_DEBUG
+ * to get all of them. State changes come from md_event_subscribe().
+ *
+ * Read it back with tools/md_telemetry_recv.cpp
+ */
+#include "sony_md_remote.h"
+
+static uint32_t _telem_records;
+static unsigned long _telem_last_counters;
+
+// the record, and it again COBS encoded. Only ever one at a time
+static uint8_t _telem_rec[MD_TELEM_RECORD_MAX];
+static uint8_t _telem_wire[MD_TELEM_WIRE_MAX];
+
+static void _md_telem_send(uint8_t type, uint32_t stamp, uint8_t bus, const uint8_t *payload, uint8_t len) {
+  if (len > MD_TELEM_PAYLOAD_MAX)
+    len = MD_TELEM_PAYLOAD_MAX;
+  _telem_rec[0] = type;
+  _telem_rec[1] = stamp;
+  _telem_rec[2] = stamp >> 8;
+  _telem_rec[3] = stamp >> 16;
+  _telem_rec[4] = stamp >> 24;
+  _telem_rec[5] = bus;
+  memcpy(&_telem_rec[MD_TELEM_HEADER_LEN], payload, len);
+  uint16_t rec_len = MD_TELEM_HEADER_LEN + len;
+  uint16_t crc = md_telem_crc(_telem_rec, rec_len);
+  _telem_rec[rec_len++] = crc;
+  _telem_rec[rec_len++] = crc >> 8;
+
+  uint16_t wire_len = md_telem_cobs_encode(_telem_rec, rec_len, _telem_wire);
+  _telem_records++;
+  MD_TELEM_PORT.write(_telem_wire, wire_len);
+}
+
+void md_telem_send(uint8_t type, const uint8_t *payload, uint8_t len) {
+  _md_telem_send(type, micros(), _md_bus->id, payload, len);
+}
+
+void md_telem_log_sink(const md_log_record_t *rec) {
+  uint8_t payload[3 + sizeof(rec->data)];
+  payload[0] = rec->level;
+  payload[1] = rec->tag;
+  payload[2] = rec->len;
+  memcpy(&payload[3], rec->data, rec->len);
+  // when it happened, not when the log got drained
+  _md_telem_send(MD_TELEM_LOG, rec->stamp, rec->bus, payload, 3 + rec->len);
+}
+
+static void _md_telem_event(const md_event_t *event, void *) {
+  uint8_t payload[MD_TELEM_PAYLOAD_MAX];
+  payload[0] = event->type;
+  payload[1] = event->value;
+  payload[2] = event->prev;
+  uint8_t len = 3;
+  for (uint16_t i = 0; event->text && i < event->text_len && len < sizeof(payload); i++)
+    payload[len++] = event->text[i];
+  md_telem_send(MD_TELEM_EVENT, payload, len);
+}
+
+#if MD_ENABLE_RECV
+void md_telem_send_counters() {
+  md_recv_stats_t stats;
+  md_recv_ring_stats_t ring;
+  md_recv_get_stats(&stats);
+  md_recv_get_ring_stats(&ring);
+
+  md_telem_counters_t c;
+  c.frames = stats.frames;
+  c.nops = stats.nops;
+  c.not_ready = stats.not_ready;
+  c.bus_avail = stats.bus_avail;
+  c.truncated = stats.truncated;
+  c.parity_errors = stats.parity_errors;
+  c.resets_mid_byte = stats.resets_mid_byte;
+  c.line_timeouts = stats.line_timeouts;
+  c.ring_dropped = ring.dropped;
+  c.log_dropped = md_log_get_dropped();
+  c.telem_records = _telem_records + 1;
+  md_telem_send(MD_TELEM_COUNTERS, (const uint8_t *)&c, sizeof(c));
+}
+#endif
+
+void md_telem_setup() {
+  md_log_set_sink(md_telem_log_sink);
+  md_event_subscribe(MD_EVENT_ALL, _md_telem_event, NULL);
+  _telem_last_counters = millis();
+}
+
+void md_telem_loop() {
+  if (millis() - _telem_last_counters < MD_TELEM_COUNTERS_MS)
+    return;
+  _telem_last_counters = millis();
+#if MD_ENABLE_RECV
+  md_telem_send_counters();
+#endif
+}
@@ -0,0 +1,105 @@
+/*
+ * Sony MD Remote telemetry wire format
+ * Barry Carter 2022 <barry.carter@gmail.com>
+ *
+ * Binary records over the serial port, instead of lines of text. Each one is
+ *  type(1) stamp(4) bus(1) payload(...) crc(2)
+ * little endian, CRC-16/CCITT over everything before it. That is COBS
+ * encoded and ends with a 0, so a receiver can always find the next one.
+ *
+ * Nothing Arduino in here, tools/md_telemetry_recv.cpp uses it on Linux too.
+ */
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+// record types, and their payloads
+#define MD_TELEM_LOG            1   // level tag len data[len], an MD_LOG() record
+#define MD_TELEM_EVENT          2   // type value prev, then the text for MD_EVENT_TEXT
+#define MD_TELEM_COUNTERS       3   // md_telem_counters_t
+
+#define MD_TELEM_HEADER_LEN     6
+// longest payload. Long text is cut short
+#define MD_TELEM_PAYLOAD_MAX    72
+#define MD_TELEM_RECORD_MAX     (MD_TELEM_HEADER_LEN + MD_TELEM_PAYLOAD_MAX + 2)
+// COBS adds a byte per 254, and the 0 on the end
+#define MD_TELEM_WIRE_MAX       (MD_TELEM_RECORD_MAX + MD_TELEM_RECORD_MAX / 254 + 2)
+
+// what the receiver and decoder have been up to, sent every so often
+typedef struct __attribute__((packed)) md_telem_counters_t {
+  uint32_t frames;
+  uint32_t nops;
+  uint32_t not_ready;
+  uint32_t bus_avail;
+  uint32_t truncated;
+  uint32_t parity_errors;
+  uint32_t resets_mid_byte;
+  uint32_t line_timeouts;
+  uint32_t ring_dropped;          // frames md_recv_loop() didn't get to in time
+  uint32_t log_dropped;           // log records lost before they were sent
+  uint32_t telem_records;         // records sent, this one included
+} md_telem_counters_t;
+
+static inline uint16_t md_telem_crc(const uint8_t *data, uint16_t len) {
+  uint16_t crc = 0xFFFF;
+  while (len--) {
+    crc ^= (uint16_t)*data++ << 8;
+    for (uint8_t i = 0; i < 8; i++)
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+// @returns the encoded length, the trailing 0 included
+static inline uint16_t md_telem_cobs_encode(const uint8_t *src, uint16_t len, uint8_t *dst) {
+  uint16_t code_at = 0;
+  uint16_t out = 1;
+  uint8_t code = 1;
+  for (uint16_t i = 0; i < len; i++) {
+    if (src[i]) {
+      dst[out++] = src[i];
+      code++;
+    }
+    if (!src[i] || code == 0xFF) {
+      dst[code_at] = code;
+      code_at = out++;
+      code = 1;
+    }
+  }
+  dst[code_at] = code;
+  dst[out++] = 0;
+  return out;
+}
+
+// src is one record off the wire, without the 0 on the end
+// @returns the decoded length, 0 if it's broken
+static inline uint16_t md_telem_cobs_decode(const uint8_t *src, uint16_t len, uint8_t *dst) {
+  uint16_t out = 0;
+  uint16_t i = 0;
+  while (i < len) {
+    uint8_t code = src[i++];
+    if (!code || i + code - 1 > len)
+      return 0;
+    for (uint8_t n = 1; n < code; n++)
+      dst[out++] = src[i++];
+    if (code != 0xFF && i < len)
+      dst[out++] = 0;
+  }
+  return out;
+}
+
+// check a decoded record, and pull the header out of it
+// @returns the payload length, or -1 if the crc is wrong
+static inline int md_telem_parse(const uint8_t *rec, uint16_t len, uint8_t *type,
+                                 uint32_t *stamp, uint8_t *bus, const uint8_t **payload) {
+  if (len < MD_TELEM_HEADER_LEN + 2)
+    return -1;
+  uint16_t crc = rec[len - 2] | (rec[len - 1] << 8);
+  if (crc != md_telem_crc(rec, len - 2))
+    return -1;
+  *type = rec[0];
+  *stamp = rec[1] | (rec[2] << 8) | ((uint32_t)rec[3] << 16) | ((uint32_t)rec[4] << 24);
+  *bus = rec[5];
+  *payload = &rec[MD_TELEM_HEADER_LEN];
+  return len - MD_TELEM_HEADER_LEN - 2;
+}
@@ -0,0 +1,491 @@
+/*
+ * Sony MD Remote host shim
+ * Barry Carter 2022 <barry.carter@gmail.com>
+ *
+ * See Arduino.h
+ *
+ * The simulator runs each endpoint on its own ucontext stack, one at a
+ * time. Every endpoint has its own clock, and the one furthest behind
+ * always goes next, so nothing it does to a wire can come before
+ * something that already happened on it. Switching only happens when a
+ * sketch touches a pin or the clock, and not even then while everyone
+ * else is sat in a delay further on, so a sketch waiting on a delay costs
+ * next to nothing.
+ *
+ * Interrupts and IntervalTimers are run on the endpoint's own stack, from
+ * whichever of those calls it was in, with its clock wound back to when
+ * they went off. That's inside a delay or a poll of the pin, so it's the
+ * same as a real one going off there.
+ */
+#include "Arduino.h"
+#include <stdarg.h>
+#include <time.h>
+#include <ucontext.h>
+
+#define HOST_SIM_STACK  (256 * 1024)
+#define HOST_SIM_MAX_EP 4
+
+HostSerial Serial;
+
+struct host_sim_ep_t {
+  const char *name;
+  ucontext_t ctx;
+  void *stack;
+  void (*setup)();
+  void (*loop)();
+  void (*resume_cb)(void *ctx);
+  void *resume_ctx;
+
+  uint64_t now;                   // ns
+  // pins on no wire just remember what was written
+  uint8_t level[HOST_NUM_PINS];
+  // and pins on one get resolved with everyone else on it
+  uint8_t mode[HOST_NUM_PINS];
+  uint8_t latch[HOST_NUM_PINS];
+  host_sim_wire_t *wire[HOST_NUM_PINS];
+
+  void (*isr[HOST_NUM_PINS])();
+  uint8_t isr_mode[HOST_NUM_PINS];
+  bool isr_pending[HOST_NUM_PINS];
+  uint64_t isr_at[HOST_NUM_PINS];
+  uint8_t isr_count;              // how many are pending
+  IntervalTimer *timers[HOST_SIM_TIMERS];
+  bool irq_off;
+  bool in_isr;
+};
+
+// outside the simulator everything happens on this one
+static host_sim_ep_t _host_default;
+static host_sim_ep_t *_host_ep = &_host_default;
+
+static bool _host_sim_on;
+static host_sim_opts_t _host_opts;
+static host_sim_ep_t *_host_eps[HOST_SIM_MAX_EP];
+static uint8_t _host_ep_count;
+static ucontext_t _host_main_ctx;
+static uint64_t _host_until_ns;
+static uint32_t _host_rand;
+
+static void _host_sim_sync();
+
+size_t HostSerial::write(const uint8_t *buf, size_t len) {
+  if (muted)
+    return len;
+  return fwrite(buf, 1, len, stdout);
+}
+
+int HostSerial::printf(const char *fmt, ...) {
+  if (muted)
+    return 0;
+  va_list args;
+  va_start(args, fmt);
+  int len = vprintf(fmt, args);
+  va_end(args);
+  return len;
+}
+
+static uint32_t _host_sim_random() {
+  // xorshift, so the same seed gives the same run
+  _host_rand ^= _host_rand << 13;
+  _host_rand ^= _host_rand >> 17;
+  _host_rand ^= _host_rand << 5;
+  return _host_rand;
+}
+
+// work out the wire from everyone on it. Driven LOW beats driven HIGH
+static void _host_wire_resolve(host_sim_wire_t *wire) {
+  uint8_t highs = 0, lows = 0, pull_ups = 0, pull_downs = 0;
+  for (uint8_t i = 0; i < wire->ends; i++) {
+    host_sim_ep_t *ep = wire->ep[i];
+    uint8_t pin = wire->pin[i];
+    switch (ep->mode[pin]) {
+      case OUTPUT:
+        if (ep->latch[pin])
+          highs++;
+        else
+          lows++;
+        break;
+      case OUTPUT_OPENDRAIN:
+        if (!ep->latch[pin])
+          lows++;
+        break;
+      case INPUT_PULLUP:
+        pull_ups++;
+        break;
+      case INPUT_PULLDOWN:
+        pull_downs++;
+        break;
+    }
+  }
+
+  uint8_t level = wire->level;
+  if (lows)
+    level = LOW;
+  else if (highs)
+    level = HIGH;
+  else if (pull_ups && !pull_downs)
+    level = HIGH;
+  else if (pull_downs && !pull_ups)
+    level = LOW;
+  else if (wire->pull != HOST_WIRE_FLOAT)
+    level = wire->pull == HOST_WIRE_PULLUP ? HIGH : LOW;
+
+  uint64_t now = _host_ep->now;
+  bool contended = highs && lows;
+  if (contended && !wire->contended) {
+    wire->contentions++;
+    wire->contended_at = now;
+  } else if (!contended && wire->contended) {
+    wire->contention_ns += now - wire->contended_at;
+  }
+  wire->contended = contended;
+
+  if (level == wire->level)
+    return;
+  wire->level = level;
+  wire->edges++;
+
+  // everyone listening gets an interrupt, us included
+  for (uint8_t i = 0; i < wire->ends; i++) {
+    host_sim_ep_t *ep = wire->ep[i];
+    uint8_t pin = wire->pin[i];
+    if (!ep->isr[pin] || ep->isr_pending[pin])
+      continue;
+    if ((ep->isr_mode[pin] == RISING && level != HIGH) || (ep->isr_mode[pin] == FALLING && level != LOW))
+      continue;
+    ep->isr_pending[pin] = true;
+    ep->isr_at[pin] = now + _host_opts.irq_ns +
+      (_host_opts.irq_jitter_ns ? _host_sim_random() % _host_opts.irq_jitter_ns : 0);
+    ep->isr_count++;
+  }
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin >= HOST_NUM_PINS)
+    return;
+  host_sim_ep_t *ep = _host_ep;
+  if (ep->wire[pin]) {
+    _host_sim_sync();
+    ep->mode[pin] = mode;
+    _host_wire_resolve(ep->wire[pin]);
+    return;
+  }
+  // inputs idle high, the bus has a pull up
+  ep->mode[pin] = mode;
+  if (mode != OUTPUT)
+    ep->level[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t level) {
+  if (pin >= HOST_NUM_PINS)
+    return;
+  host_sim_ep_t *ep = _host_ep;
+  if (ep->wire[pin]) {
+    _host_sim_sync();
+    ep->latch[pin] = level;
+    _host_wire_resolve(ep->wire[pin]);
+    return;
+  }
+  ep->level[pin] = level;
+}
+
+uint8_t digitalRead(uint8_t pin) {
+  if (pin >= HOST_NUM_PINS)
+    return LOW;
+  host_sim_ep_t *ep = _host_ep;
+  if (ep->wire[pin]) {
+    ep->now += _host_opts.call_ns;
+    _host_sim_sync();
+    return ep->wire[pin]->level;
+  }
+  return ep->level[pin];
+}
+
+unsigned long micros() {
+  if (_host_sim_on) {
+    _host_ep->now += _host_opts.call_ns;
+    _host_sim_sync();
+    return (unsigned long)(_host_ep->now / 1000);
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)(ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+unsigned long millis() {
+  return micros() / 1000;
+}
+
+void delayMicroseconds(uint32_t us) {
+  if (_host_sim_on) {
+    _host_ep->now += us * 1000ULL;
+    _host_sim_sync();
+    return;
+  }
+  unsigned long start = micros();
+  while (micros() - start < us);
+}
+
+void delay(uint32_t ms) {
+  delayMicroseconds(ms * 1000);
+}
+
+void yield() {
+  if (!_host_sim_on)
+    return;
+  _host_ep->now += _host_opts.yield_ns;
+  _host_sim_sync();
+}
+
+void attachInterrupt(int irq, void (*fn)(), int mode) {
+  if (irq < 0 || irq >= HOST_NUM_PINS)
+    return;
+  _host_ep->isr[irq] = fn;
+  _host_ep->isr_mode[irq] = mode;
+}
+
+void detachInterrupt(int irq) {
+  if (irq < 0 || irq >= HOST_NUM_PINS)
+    return;
+  host_sim_ep_t *ep = _host_ep;
+  ep->isr[irq] = NULL;
+  if (ep->isr_pending[irq]) {
+    ep->isr_pending[irq] = false;
+    ep->isr_count--;
+  }
+}
+
+void noInterrupts() {
+  _host_ep->irq_off = true;
+}
+
+void interrupts() {
+  _host_ep->irq_off = false;
+  // anything that came in meanwhile goes off now
+  if (_host_sim_on)
+    _host_sim_sync();
+}
+
+// 0 in an interrupt too, like on the Teensy, where it's the NVIC keeping the
+// others out. Here that's in_isr
+uint32_t __get_PRIMASK() {
+  return _host_ep->irq_off;
+}
+
+void __set_PRIMASK(uint32_t primask) {
+  if (primask)
+    noInterrupts();
+  else
+    interrupts();
+}
+
+bool IntervalTimer::begin(void (*fn)(), unsigned long us) {
+  host_sim_ep_t *e = _host_ep;
+  this->fn = fn;
+  next_us = us;
+  due_ns = e->now + us * 1000ULL;
+  if (ep == e)
+    return true;
+  for (uint8_t i = 0; i < HOST_SIM_TIMERS; i++) {
+    if (!e->timers[i]) {
+      e->timers[i] = this;
+      ep = e;
+      return true;
+    }
+  }
+  return false;
+}
+
+void IntervalTimer::update(unsigned long us) {
+  next_us = us;
+}
+
+void IntervalTimer::end() {
+  if (!ep)
+    return;
+  for (uint8_t i = 0; i < HOST_SIM_TIMERS; i++) {
+    if (ep->timers[i] == this)
+      ep->timers[i] = NULL;
+  }
+  ep = nullptr;
+}
+
+// @returns when ep next has to do something, an interrupt or carrying on.
+// which is the pin, HOST_NUM_PINS + the timer, or -1 to carry on
+static uint64_t _host_sim_next(host_sim_ep_t *ep, int *which) {
+  uint64_t at = ep->now;
+  *which = -1;
+  if (ep->in_isr || ep->irq_off)
+    return at;
+  if (ep->isr_count) {
+    for (int pin = 0; pin < HOST_NUM_PINS; pin++) {
+      if (ep->isr_pending[pin] && ep->isr_at[pin] <= at) {
+        at = ep->isr_at[pin];
+        *which = pin;
+      }
+    }
+  }
+  for (int i = 0; i < HOST_SIM_TIMERS; i++) {
+    if (ep->timers[i] && ep->timers[i]->due_ns <= at) {
+      at = ep->timers[i]->due_ns;
+      *which = HOST_NUM_PINS + i;
+    }
+  }
+  return at;
+}
+
+// an interrupt or timer, at the time it went off
+static void _host_sim_run_isr(host_sim_ep_t *ep, uint64_t at, int which) {
+  uint64_t now = ep->now;
+  void (*fn)();
+  if (which < HOST_NUM_PINS) {
+    ep->isr_pending[which] = false;
+    ep->isr_count--;
+    fn = ep->isr[which];
+  } else {
+    IntervalTimer *timer = ep->timers[which - HOST_NUM_PINS];
+    timer->due_ns += timer->next_us * 1000ULL;
+    fn = timer->fn;
+  }
+  ep->now = at;
+  ep->in_isr = true;
+  fn();
+  ep->in_isr = false;
+  // the main code was held up if it took longer than the wait it was in
+  if (ep->now < now)
+    ep->now = now;
+}
+
+static void _host_sim_resumed(host_sim_ep_t *ep) {
+  _host_ep = ep;
+  if (ep->resume_cb)
+    ep->resume_cb(ep->resume_ctx);
+}
+
+// Let everyone who is behind us catch up, and take any of our own
+// interrupts that are due, before we carry on
+static void _host_sim_sync() {
+  host_sim_ep_t *self = _host_ep;
+  if (!_host_sim_on || self == &_host_default)
+    return;
+
+  while (1) {
+    int which;
+    host_sim_ep_t *next = self;
+    uint64_t next_at = _host_sim_next(self, &which);
+    for (uint8_t i = 0; i < _host_ep_count; i++) {
+      int other_which;
+      uint64_t at = _host_sim_next(_host_eps[i], &other_which);
+      if (at < next_at) {
+        next = _host_eps[i];
+        next_at = at;
+      }
+    }
+
+    if (next_at >= _host_until_ns) {
+      // that's the end of this run, wait here for the next
+      swapcontext(&self->ctx, &_host_main_ctx);
+      _host_sim_resumed(self);
+      continue;
+    }
+    if (next != self) {
+      // one that hasn't started yet finds out who it is from _host_ep
+      _host_ep = next;
+      swapcontext(&self->ctx, &next->ctx);
+      _host_sim_resumed(self);
+      continue;
+    }
+    if (which < 0)
+      return;
+    _host_sim_run_isr(self, next_at, which);
+  }
+}
+
+static void _host_sim_entry() {
+  host_sim_ep_t *ep = _host_ep;
+  _host_sim_resumed(ep);
+  ep->setup();
+  while (1) {
+    ep->loop();
+    yield();
+  }
+}
+
+void host_sim_init(const host_sim_opts_t *opts) {
+  _host_opts = *opts;
+  _host_rand = opts->seed ? opts->seed : 1;
+  _host_ep_count = 0;
+}
+
+// on a stack of its own. Out here, as getcontext() returning twice has gcc
+// worrying about the locals round it
+static void _host_sim_make_ctx(host_sim_ep_t *ep) {
+  getcontext(&ep->ctx);
+  ep->ctx.uc_stack.ss_sp = ep->stack;
+  ep->ctx.uc_stack.ss_size = HOST_SIM_STACK;
+  ep->ctx.uc_link = NULL;
+  makecontext(&ep->ctx, _host_sim_entry, 0);
+}
+
+host_sim_ep_t *host_sim_add(const char *name, void (*setup)(), void (*loop)(), uint64_t start_us) {
+  if (_host_ep_count >= HOST_SIM_MAX_EP)
+    return NULL;
+  host_sim_ep_t *ep = (host_sim_ep_t *)calloc(1, sizeof(host_sim_ep_t));
+  ep->name = name;
+  ep->setup = setup;
+  ep->loop = loop;
+  ep->now = start_us * 1000;
+  ep->stack = malloc(HOST_SIM_STACK);
+  _host_sim_make_ctx(ep);
+  _host_eps[_host_ep_count++] = ep;
+  return ep;
+}
+
+void host_sim_on_resume(host_sim_ep_t *ep, void (*cb)(void *ctx), void *ctx) {
+  ep->resume_cb = cb;
+  ep->resume_ctx = ctx;
+}
+
+host_sim_wire_t *host_sim_wire(host_sim_wire_t *wire, host_sim_ep_t *ep, uint8_t pin, uint8_t pull) {
+  if (pin >= HOST_NUM_PINS)
+    return NULL;
+  if (!wire) {
+    wire = (host_sim_wire_t *)calloc(1, sizeof(host_sim_wire_t));
+    wire->pull = pull;
+    wire->level = pull == HOST_WIRE_PULLUP ? HIGH : LOW;
+  }
+  if (wire->ends >= HOST_SIM_ENDS)
+    return NULL;
+  wire->ep[wire->ends] = ep;
+  wire->pin[wire->ends] = pin;
+  wire->ends++;
+  ep->wire[pin] = wire;
+  return wire;
+}
+
+void host_sim_run(uint64_t until_us) {
+  if (!_host_ep_count)
+    return;
+  _host_until_ns = until_us * 1000;
+  _host_sim_on = true;
+
+  host_sim_ep_t *first = _host_eps[0];
+  int which;
+  for (uint8_t i = 1; i < _host_ep_count; i++) {
+    if (_host_sim_next(_host_eps[i], &which) < _host_sim_next(first, &which))
+      first = _host_eps[i];
+  }
+  _host_ep = first;
+  swapcontext(&_host_main_ctx, &first->ctx);
+
+  _host_sim_on = false;
+  _host_ep = &_host_default;
+}
+
+host_sim_ep_t *host_sim_current() {
+  return _host_sim_on ? _host_ep : NULL;
+}
+
+const char *host_sim_name(host_sim_ep_t *ep) {
+  return ep->name;
+}
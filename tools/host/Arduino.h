@@ -0,0 +1,168 @@
+/*
+ * Sony MD Remote host shim
+ * Barry Carter 2022 <barry.carter@gmail.com> 
+ *  
+ * Just enough of the Arduino/Teensy API to build the library on Linux,
+ * so the real decoder and parser can be run against recorded traces.
+ * 
+ * Pins only remember what was written to them, and time is the host clock.
+ *
+ * Or, with host_sim_*(), several sketches run in one process in virtual
+ * time, each with its own pins, and pins on different ones wired together.
+ * See Arduino.cpp
+ */
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+
+#define HIGH            1
+#define LOW             0
+#define INPUT           0
+#define OUTPUT          1
+#define INPUT_PULLUP    2
+#define INPUT_PULLDOWN  3
+#define OUTPUT_OPENDRAIN 4
+#define RISING          2
+#define FALLING         3
+#define CHANGE          4
+#define DEC             10
+#define HEX             16
+
+#define HOST_NUM_PINS   64
+
+typedef bool boolean;
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t level);
+uint8_t digitalRead(uint8_t pin);
+static inline uint8_t digitalReadFast(uint8_t pin) { return digitalRead(pin); }
+static inline void digitalWriteFast(uint8_t pin, uint8_t level) { digitalWrite(pin, level); }
+
+unsigned long micros();
+unsigned long millis();
+void delayMicroseconds(uint32_t us);
+void delay(uint32_t ms);
+void yield();
+
+static inline int digitalPinToInterrupt(uint8_t pin) { return pin; }
+void attachInterrupt(int irq, void (*fn)(), int mode);
+void detachInterrupt(int irq);
+void noInterrupts();
+void interrupts();
+// like CMSIS, 1 if interrupts are off
+uint32_t __get_PRIMASK();
+void __set_PRIMASK(uint32_t primask);
+static inline void __disable_irq() { noInterrupts(); }
+static inline void __enable_irq() { interrupts(); }
+
+struct host_sim_ep_t;
+
+// Only ever goes off in the simulator
+class IntervalTimer {
+public:
+  bool begin(void (*fn)(), unsigned long us);
+  // like the PIT, this is for the period after the one running now
+  void update(unsigned long us);
+  void end();
+  void priority(uint8_t n) { (void)n; }
+
+  void (*fn)() = nullptr;
+  unsigned long next_us = 0;
+  uint64_t due_ns = 0;
+  host_sim_ep_t *ep = nullptr;
+};
+
+class String {
+public:
+  String(const char *str = "") : _str(str) {}
+  void concat(const char *str) { _str += str; }
+  void concat(char c) { _str += c; }
+  void concat(long val) { _str += std::to_string(val); }
+  void concat(int val) { concat((long)val); }
+  void concat(unsigned char val) { concat((long)val); }
+  void concat(unsigned long val) { concat((long)val); }
+  String &operator=(const char *str) { _str = str; return *this; }
+  const char *c_str() const { return _str.c_str(); }
+  unsigned int length() const { return _str.length(); }
+private:
+  std::string _str;
+};
+
+// USB serial goes to stdout. It can be muted for benchmarking
+class HostSerial {
+public:
+  void begin(long baud) { (void)baud; }
+  void update(unsigned long us) { (void)us; }
+  void end() {}
+  int available() { return 0; }
+  int read() { return -1; }
+  void flush() { fflush(stdout); }
+  operator bool() { return true; }
+  size_t write(uint8_t c) { return write(&c, 1); }
+  size_t write(const uint8_t *buf, size_t len);
+  int printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+  void print(const char *str) { printf("%s", str); }
+  void print(const String &str) { print(str.c_str()); }
+  void print(char c) { printf("%c", c); }
+  void print(long val, int base = DEC) { printf(base == HEX ? "%lX" : "%ld", val); }
+  void print(unsigned long val, int base = DEC) { printf(base == HEX ? "%lX" : "%lu", val); }
+  void print(int val, int base = DEC) { print((long)val, base); }
+  void print(unsigned int val, int base = DEC) { print((unsigned long)val, base); }
+  void print(unsigned char val, int base = DEC) { print((unsigned long)val, base); }
+  template <typename T> void println(T val) { print(val); println(); }
+  template <typename T> void println(T val, int base) { print(val, base); println(); }
+  void println() { print("\n"); }
+
+  bool muted = false;
+};
+
+extern HostSerial Serial;
+
+// The simulator. Each endpoint is a sketch, setup() then loop() forever, on
+// its own stack with its own pins and clock. Time only moves when a sketch
+// waits or looks at the outside world, and everything on the wires happens
+// in time order, whoever does it.
+#define HOST_WIRE_FLOAT     0   // stays where it was last driven
+#define HOST_WIRE_PULLUP    1
+#define HOST_WIRE_PULLDOWN  2
+
+#define HOST_SIM_ENDS       4   // pins on one wire
+#define HOST_SIM_TIMERS     4   // IntervalTimers running on one endpoint
+
+typedef struct host_sim_opts_t {
+  uint32_t call_ns;               // what micros(), millis() and digitalRead() take
+  uint32_t yield_ns;              // yield(), so the time between loop()s too
+  uint32_t irq_ns;                // pin change to interrupt
+  uint32_t irq_jitter_ns;         // up to this much more, at random
+  uint32_t seed;
+} host_sim_opts_t;
+
+typedef struct host_sim_wire_t {
+  host_sim_ep_t *ep[HOST_SIM_ENDS];
+  uint8_t pin[HOST_SIM_ENDS];
+  uint8_t ends;
+  uint8_t pull;                   // HOST_WIRE_
+  uint8_t level;
+  bool contended;                 // HIGH and LOW both driven right now
+  uint64_t contended_at;
+  // stats
+  uint32_t edges;
+  uint32_t contentions;
+  uint64_t contention_ns;
+} host_sim_wire_t;
+
+void host_sim_init(const host_sim_opts_t *opts);
+// start_us is when it powers up
+host_sim_ep_t *host_sim_add(const char *name, void (*setup)(), void (*loop)(), uint64_t start_us);
+// called every time ep gets going again, e.g. to put its globals back
+void host_sim_on_resume(host_sim_ep_t *ep, void (*cb)(void *ctx), void *ctx);
+// add ep's pin to the wire, or a new one if wire is NULL
+host_sim_wire_t *host_sim_wire(host_sim_wire_t *wire, host_sim_ep_t *ep, uint8_t pin, uint8_t pull);
+// run everything until until_us. Can be called again to carry on
+void host_sim_run(uint64_t until_us);
+// the endpoint running right now, NULL outside the simulator
+host_sim_ep_t *host_sim_current();
+const char *host_sim_name(host_sim_ep_t *ep);
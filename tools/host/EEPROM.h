@@ -0,0 +1,28 @@
+/*
+ * Sony MD Remote host shim, EEPROM
+ * Barry Carter 2022 <barry.carter@gmail.com> 
+ *  
+ * Just RAM, so anything saved is gone when the program exits
+ */
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+class HostEEPROM {
+public:
+  uint8_t mem[1080];
+
+  HostEEPROM() { memset(mem, 0xFF, sizeof(mem)); }
+
+  template <typename T> T &get(int addr, T &t) {
+    memcpy(&t, &mem[addr], sizeof(T));
+    return t;
+  }
+
+  template <typename T> const T &put(int addr, const T &t) {
+    memcpy(&mem[addr], &t, sizeof(T));
+    return t;
+  }
+};
+
+static HostEEPROM EEPROM;
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Sony MD Remote analyser check
+# Barry Carter 2022 <barry.carter@gmail.com>
+#
+# Builds md_trace_analyse and checks that cutting a trace up into chunks,
+# however small, gives the same frames, timeline and totals as decoding it
+# in one go. The trace comes from md_trace_gen.py, with the state only
+# every 10th round and a title longer than the text ring, so both of them
+# go back further than a chunk's warm up.
+#
+# Run from the top of the repo:
+#  tools/md_check_analyse.sh [trace.csv|capture.mde ...]
+# Exits 1 if any differ.
+set -e
+
+CXX=${CXX:-g++}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+$CXX -O2 -std=gnu++17 -pthread -Itools/host -DDUMP_MD_PACKET=0 -DMD_LOG_LEVEL=0 \
+  -DMD_BUS_TLS=thread_local -o "$OUT/analyse" \
+  tools/md_trace_analyse.cpp tools/host/Arduino.cpp src/[a-z]*.cpp
+
+if [ $# -eq 0 ]; then
+  python3 tools/md_trace_gen.py -n 300 -j 6 -b 7 -o 10 \
+    -t "Track %d, with a title that goes on for longer than the seventy chars of the ring" > "$OUT/gen.mde"
+  set -- "$OUT/gen.mde"
+fi
+
+failed=0
+for trace in "$@"; do
+  # one chunk, the whole file
+  "$OUT/analyse" -s -d -j 1 -k 1048576 "$trace" 2>/dev/null > "$OUT/whole"
+  for k in 1 2 5 16 64; do
+    "$OUT/analyse" -s -d -j 4 -k $k "$trace" 2>/dev/null > "$OUT/chunked"
+    if diff -u "$OUT/whole" "$OUT/chunked" > "$OUT/diff"; then
+      echo "$trace: -k $k ok, $(grep -c . "$OUT/whole") lines"
+    else
+      echo "$trace: -k $k differs"
+      head -50 "$OUT/diff"
+      failed=1
+    fi
+  done
+done
+exit $failed
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Sony MD Remote receiver check
+# Barry Carter 2022 <barry.carter@gmail.com>
+#
+# Builds md_trace_decode polling the pin, and again with the pin change
+# interrupt (MD_RECV_USE_ISR), plays each trace out on the simulated pin
+# to both (md_trace_decode -p), and checks they get the same frames as
+# feeding the edges straight to the decoder. The times are left out, they
+# differ by however long each took to notice.
+#
+# Run from the top of the repo:
+#  tools/md_check_recv.sh [trace.csv|capture.mde ...]
+# tools/traces/md_sample.mde if none are given. Exits 1 if any differ.
+set -e
+
+CXX=${CXX:-g++}
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+for isr in 0 1; do
+  $CXX -O2 -std=gnu++17 -Itools/host -DDUMP_MD_PACKET=0 -DMD_RECV_USE_ISR=$isr -o "$OUT/decode$isr" \
+    tools/md_trace_decode.cpp tools/host/Arduino.cpp src/[a-z]*.cpp
+done
+
+# the frames and the totals, without the times or the parse timings
+frames() {
+  "$@" 2>/dev/null | grep -v "^resets mid byte" | cut -c13-
+}
+
+[ $# -gt 0 ] || set -- tools/traces/md_sample.mde
+failed=0
+for trace in "$@"; do
+  frames "$OUT/decode0" "$trace" > "$OUT/edges"
+  for isr in 0 1; do
+    frames "$OUT/decode$isr" -p "$trace" > "$OUT/played"
+    name=$([ $isr = 1 ] && echo "interrupt" || echo "polling")
+    if diff -u "$OUT/edges" "$OUT/played" > "$OUT/diff"; then
+      echo "$trace: $name ok, $(grep -c . "$OUT/edges") lines"
+    else
+      echo "$trace: $name differs"
+      cat "$OUT/diff"
+      failed=1
+    fi
+  done
+done
+exit $failed
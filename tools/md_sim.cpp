@@ -0,0 +1,354 @@
+/*
+ * Sony MD Remote bus simulator
+ * Barry Carter 2022 <barry.carter@gmail.com>
+ *
+ * sony_md_host_emulator (being the player) and sony_md_remote_emulator
+ * (being the remote) in one process, the host's MD_SEND_DATA_PIN wired to
+ * the remote's MD_DATA_PIN, in virtual time (see tools/host/Arduino.cpp).
+ * Both sketches run as they are, on the real library, each on its own
+ * md_bus_t.
+ *
+ * The host lets go of the line to clock in the remote's header bits, and
+ * the remote only ever drives it HIGH, so the line has to fall by itself
+ * for the remote to see the clock. The wire is pulled down for that, -u
+ * shows what happens with a pull up instead.
+ *
+ * Each session is forked off before anything has run, so each one starts
+ * from power on. They get their own seed, which moves when the remote
+ * powers up and how long its interrupts take to go off.
+ *
+ * Build from the top of the repo:
+ *  g++ -O2 -std=gnu++17 -Itools/host -DDUMP_MD_PACKET=0 -DMD_RECV_USE_ISR=1 \
+ *      -o md_sim tools/md_sim.cpp tools/host/Arduino.cpp src/[a-z]*.cpp
+ * It needs MD_RECV_USE_ISR=1. Polling the pin, the remote emulator's own
+ * md_send_loop() NOPs (to nothing, on MD_SEND_DATA_PIN) keep it away from
+ * the pin long enough to miss part of every frame with data in, so no
+ * session would pass.
+ *
+ * Usage:
+ *  md_sim [-n sessions] [-j jobs] [-t ms] [-s seed] [-c] [-u] [-v]
+ *   -n  how many sessions, 1 by default
+ *   -j  how many to run at once, all the cores by default
+ *   -t  how long each one runs for, in virtual time. 1500ms by default,
+ *       20000ms with -c
+ *   -s  seed for the first session, the rest count up from it
+ *   -c  md_send_calibrate() against the remote first, and carry on with
+ *       what it finds
+ *   -u  pull the wire up instead of down
+ *   -v  print what the sketches print, and every session
+ *
+ * A session passes if the remote put together the title the host sent,
+ * with no bad frames on the way, and the host saw the remote come up.
+ * Once it has the title the remote sends a packet back, and the host has
+ * to read that once, with the right bytes and parity. With -c the
+ * calibration has to work too, and settle on quicker timing that is still
+ * inside what the remote's receiver takes (see _md_sim_check_timing()).
+ * Exits 1 if any didn't.
+ */
+#include "../src/sony_md_remote.h"
+#if !MD_RECV_USE_ISR
+#error "md_sim needs -DMD_RECV_USE_ISR=1, polling the remote never gets a whole frame"
+#endif
+#include <sys/wait.h>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+
+namespace host_emulator {
+#include "../sony_md_host_emulator/sony_md_host_emulator.ino"
+}
+
+namespace remote_emulator {
+#include "../sony_md_remote_emulator/sony_md_remote_emulator.ino"
+}
+
+// what the host sends once the remote is up
+#define MD_SIM_TITLE      "Titleb"
+// and what the remote sends back once it has the title
+static const uint8_t _md_sim_packet[10] = { 0xC0, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0xFF };
+
+typedef struct md_sim_result_t {
+  uint32_t seed;
+  bool done;                      // false if it never got as far as handing this back
+  bool pass;
+  md_recv_stats_t remote;         // the remote's receiver
+  uint8_t header;                 // the last header the host got from the remote
+  uint32_t polls;                 // NOPs from the host
+  uint32_t edges;
+  uint32_t contentions;           // both ends driving the wire, opposite ways
+  uint64_t contention_ns;
+  char text[32];                  // the last text the remote put together
+  uint32_t reads;                 // packets the host read from the remote
+  uint32_t read_parity_errors;
+  uint8_t read[10];               // the last of them
+  bool calibrated;                // -c, and md_send_calibrate() said yes
+  md_send_timing_t timing;        // what the host ended up sending with
+} md_sim_result_t;
+
+typedef struct md_sim_ep_t {
+  md_bus_t bus;
+  bool muted;
+} md_sim_ep_t;
+
+static md_sim_ep_t _host;
+static md_sim_ep_t _remote;
+static md_sim_result_t _result;
+// -c, the host calibrates before it does anything else
+static bool _md_sim_calibrate;
+
+// the remote emulator's callback is in its namespace, so pass it on
+void md_text_received_cb(char *text, uint8_t len) {
+  if (md_bus_current() == &_remote.bus)
+    remote_emulator::md_text_received_cb(text, len);
+}
+
+static void _md_sim_resume(void *ctx) {
+  md_sim_ep_t *ep = (md_sim_ep_t *)ctx;
+  md_bus_select(&ep->bus);
+  Serial.muted = ep->muted;
+}
+
+// and the host's
+void md_send_remote_packet_cb(uint8_t *data, uint8_t len, bool parity_ok) {
+  if (md_bus_current() != &_host.bus)
+    return;
+  _result.reads++;
+  if (!parity_ok)
+    _result.read_parity_errors++;
+  memcpy(_result.read, data, len < sizeof(_result.read) ? len : sizeof(_result.read));
+}
+
+static void _md_sim_text(const md_event_t *event, void *) {
+  uint16_t len = event->text_len < sizeof(_result.text) - 1 ? event->text_len : sizeof(_result.text) - 1;
+  memcpy(_result.text, event->text, len);
+  _result.text[len] = 0;
+  // got it, say so. The host reads it the next time we ask for the bus
+  if (!strcmp(_result.text, MD_SIM_TITLE)) {
+    memcpy(md_recv_get_send_buf(), _md_sim_packet, sizeof(_md_sim_packet));
+    md_recv_set_send_len(sizeof(_md_sim_packet));
+  }
+}
+
+static void _md_sim_remote_setup() {
+  remote_emulator::setup();
+  md_event_subscribe(MD_EVENT_MASK(MD_EVENT_TEXT), _md_sim_text, NULL);
+}
+
+// wait for the remote like the host emulator does, then find the fastest
+// timing it takes. The sketch carries on with that
+static void _md_sim_host_setup() {
+  if (_md_sim_calibrate) {
+    md_setup();
+    while (!(md_send_get_cmd() & (1 << MD_HEADER_REMOTE_IS_INIT))) {
+      md_loop();
+      delayMicroseconds(30000);
+    }
+    _result.calibrated = md_send_calibrate(false);
+    // it tried timings the remote can't take on purpose, so start its
+    // counters again from here
+    md_bus_select(&_remote.bus);
+    md_recv_reset_stats();
+    md_bus_select(&_host.bus);
+  }
+  host_emulator::setup();
+}
+
+// -c has to have found something quicker than the stock timing, that the
+// remote still takes. The remote emulator's write backs last MD_PULSE_LONG_US
+// whatever we send, and the host reads its bits that long after letting go,
+// so that one can't move much. The resets have to stay in the remote's window
+static bool _md_sim_check_timing() {
+  const md_send_timing_t *t = &_result.timing;
+  return _result.calibrated &&
+    t->pulse_short_us < MD_PULSE_SHORT_US && t->pulse_long_us <= MD_PULSE_LONG_US &&
+    t->pulse_long_us > MD_PULSE_LONG_US - MD_PULSE_LONG_US / 8 &&
+    t->reset_low_us > RESET_LOW_US_MIN && t->reset_low_us < MD_PULSE_RESET_LOW_US &&
+    t->reset_high_us < MD_PULSE_RESET_HIGH_US &&
+    t->byte_gap_us < MD_INTER_BYTE_DELAY && t->data_gap_us < 2 * MD_INTER_BYTE_DELAY;
+}
+
+static void _md_sim_session(uint32_t seed, uint32_t run_ms, uint8_t pull, bool verbose) {
+  // Roughly a Teensy 4, except loop() comes round less often than it
+  // would. That's just how quickly frames get parsed after the interrupt
+  // has them, and it's most of what a session costs to run
+  host_sim_opts_t opts;
+  opts.call_ns = 100;
+  opts.yield_ns = 20000;
+  opts.irq_ns = 500;
+  opts.irq_jitter_ns = 1500;
+  opts.seed = seed;
+  host_sim_init(&opts);
+
+  md_bus_init(&_host.bus, MD_DATA_PIN, MD_SEND_DATA_PIN);
+  md_bus_init(&_remote.bus, MD_DATA_PIN, MD_SEND_DATA_PIN);
+  _host.muted = _remote.muted = !verbose;
+
+  // the remote comes up somewhere in the host's first 20ms
+  host_sim_ep_t *host = host_sim_add("host", _md_sim_host_setup, host_emulator::loop, 0);
+  host_sim_ep_t *remote = host_sim_add("remote", _md_sim_remote_setup, remote_emulator::loop, seed % 20000);
+  host_sim_on_resume(host, _md_sim_resume, &_host);
+  host_sim_on_resume(remote, _md_sim_resume, &_remote);
+  host_sim_wire_t *wire = host_sim_wire(NULL, host, MD_SEND_DATA_PIN, pull);
+  host_sim_wire(wire, remote, MD_DATA_PIN, pull);
+
+  host_sim_run(run_ms * 1000ULL);
+
+  _result.seed = seed;
+  _result.done = true;
+  md_bus_select(&_remote.bus);
+  md_recv_get_stats(&_result.remote);
+  md_bus_select(&_host.bus);
+  _result.header = md_send_get_cmd();
+  md_send_get_timing(&_result.timing);
+  _result.polls = _host.bus.send.poll_stats.polls;
+  _result.edges = wire->edges;
+  _result.contentions = wire->contentions;
+  _result.contention_ns = wire->contention_ns;
+
+  _result.pass = _result.remote.frames && !_result.remote.parity_errors && !_result.remote.truncated &&
+    !strcmp(_result.text, MD_SIM_TITLE) &&
+    (_result.header & (1 << MD_HEADER_REMOTE_IS_INIT)) && !(_result.header & (1 << MD_HEADER_REMOTE_ERROR)) &&
+    _result.reads == 1 && !_result.read_parity_errors && !memcmp(_result.read, _md_sim_packet, sizeof(_md_sim_packet)) &&
+    (!_md_sim_calibrate || _md_sim_check_timing());
+}
+
+static void _md_sim_print(const md_sim_result_t *r) {
+  if (!r->done) {
+    printf("seed %u: crashed\n", r->seed);
+    return;
+  }
+  printf("seed %u: %s frames %u nops %u truncated %u parity %u write backs %u header %02x polls %u "
+    "edges %u contention %u (%lluus) text \"%s\" reads %u (parity %u)",
+    r->seed, r->pass ? "ok" : "FAIL", r->remote.frames, r->remote.nops, r->remote.truncated,
+    r->remote.parity_errors, r->remote.write_backs, r->header, r->polls, r->edges, r->contentions,
+    (unsigned long long)(r->contention_ns / 1000), r->text, r->reads, r->read_parity_errors);
+  for (size_t i = 0; r->reads && i < sizeof(r->read); i++)
+    printf(" %02x", r->read[i]);
+  if (_md_sim_calibrate)
+    printf(" calibrated %s short %u long %u reset %u/%u gaps %u/%u", r->calibrated ? "ok" : "FAIL",
+      r->timing.pulse_short_us, r->timing.pulse_long_us, r->timing.reset_low_us, r->timing.reset_high_us,
+      r->timing.byte_gap_us, r->timing.data_gap_us);
+  printf("\n");
+}
+
+typedef struct md_sim_job_t {
+  pid_t pid;
+  int fd;
+  uint32_t seed;
+} md_sim_job_t;
+
+int main(int argc, char **argv) {
+  uint32_t sessions = 1;
+  unsigned jobs = std::thread::hardware_concurrency();
+  uint32_t run_ms = 0;
+  uint32_t seed = 1;
+  uint8_t pull = HOST_WIRE_PULLDOWN;
+  bool verbose = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:j:t:s:cuv")) != -1) {
+    switch (opt) {
+      case 'n':
+        sessions = strtoul(optarg, NULL, 0);
+        break;
+      case 'j':
+        jobs = atoi(optarg);
+        break;
+      case 't':
+        run_ms = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        seed = strtoul(optarg, NULL, 0);
+        break;
+      case 'c':
+        _md_sim_calibrate = true;
+        break;
+      case 'u':
+        pull = HOST_WIRE_PULLUP;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n sessions] [-j jobs] [-t ms] [-s seed] [-c] [-u] [-v]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (!jobs)
+    jobs = 1;
+  // calibrating takes about 12s on its own
+  if (!run_ms)
+    run_ms = _md_sim_calibrate ? 20000 : 1500;
+  fflush(stdout);
+
+  // each session in a child of its own, so they all start from scratch
+  std::vector<md_sim_job_t> running;
+  uint32_t started = 0, passed = 0, failed = 0;
+  md_sim_result_t total = {};
+  auto start = std::chrono::steady_clock::now();
+  while (started < sessions || !running.empty()) {
+    if (started < sessions && running.size() < jobs) {
+      int fds[2];
+      if (pipe(fds)) {
+        perror("pipe");
+        return 1;
+      }
+      uint32_t session_seed = seed + started++;
+      pid_t pid = fork();
+      if (pid < 0) {
+        perror("fork");
+        return 1;
+      }
+      if (!pid) {
+        close(fds[0]);
+        _md_sim_session(session_seed, run_ms, pull, verbose && sessions == 1);
+        fflush(stdout);
+        if (write(fds[1], &_result, sizeof(_result)) != sizeof(_result))
+          _exit(1);
+        _exit(0);
+      }
+      close(fds[1]);
+      running.push_back({ pid, fds[0], session_seed });
+      continue;
+    }
+
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    for (size_t i = 0; i < running.size(); i++) {
+      if (running[i].pid != pid)
+        continue;
+      md_sim_result_t r = {};
+      r.seed = running[i].seed;
+      if (read(running[i].fd, &r, sizeof(r)) != sizeof(r))
+        r.done = false;
+      close(running[i].fd);
+      running.erase(running.begin() + i);
+
+      if (r.pass)
+        passed++;
+      else
+        failed++;
+      if (verbose || !r.pass)
+        _md_sim_print(&r);
+      total.remote.frames += r.remote.frames;
+      total.remote.nops += r.remote.nops;
+      total.remote.truncated += r.remote.truncated;
+      total.remote.parity_errors += r.remote.parity_errors;
+      total.remote.write_backs += r.remote.write_backs;
+      total.polls += r.polls;
+      total.edges += r.edges;
+      total.contentions += r.contentions;
+      break;
+    }
+  }
+
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%u sessions, %u passed, %u failed: frames %u nops %u truncated %u parity %u write backs %u "
+    "polls %u edges %u contention %u\n",
+    sessions, passed, failed, total.remote.frames, total.remote.nops, total.remote.truncated,
+    total.remote.parity_errors, total.remote.write_backs, total.polls, total.edges, total.contentions);
+  fprintf(stderr, "%.3f s, %.0f sessions/s, %.0fx realtime, %u at once\n",
+    secs, sessions / secs, sessions * run_ms / 1000.0 / secs, jobs);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * Sony MD Remote telemetry receiver
+ * Barry Carter 2022 <barry.carter@gmail.com>
+ *
+ * Reads the binary records MD_ENABLE_TELEMETRY sends (see
+ * src/sony_md_telemetry.h) from the Teensy's serial port, a capture of it
+ * or stdin, checks them and prints them.
+ *
+ * Build from the top of the repo:
+ *  g++ -O2 -std=gnu++17 -Itools/host -o md_telemetry_recv tools/md_telemetry_recv.cpp
+ *
+ * Usage:
+ *  md_telemetry_recv [-q] [-b baud] /dev/ttyACM0|capture.bin|-
+ *   -q  don't print the records, just the totals
+ *   -b  baud rate, if it's a tty. USB serial doesn't care
+ *
+ * Or straight from a recorded trace, without any hardware:
+ *  md_trace_decode -t trace.csv | md_telemetry_recv -
+ */
+#include "../src/sony_md_remote.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+
+static const char *_levels = "-EWID";
+static const char *_tags[] = { "RECV", "PARITY", "RESET", "SEND", "REMOTE", "WAVE", "JTTEXT" };
+static const char *_events[] = {
+  "BACKLIGHT", "VOLUME", "PLAY_MODE", "REC_INDICATOR", "BATTERY",
+  "EQ", "ALARM", "TRACK", "PLAY_STATE", "TEXT",
+};
+
+typedef struct md_telem_totals_t {
+  unsigned long records;
+  unsigned long by_type[MD_TELEM_COUNTERS + 1];
+  unsigned long bad_crc;
+  unsigned long bad_cobs;
+  unsigned long overruns;         // too long to be one of ours, e.g. text on the line
+  unsigned long bytes;
+} md_telem_totals_t;
+
+static md_telem_totals_t _totals;
+static bool _quiet;
+static volatile sig_atomic_t _stop;
+
+static void _print_record(uint8_t type, uint32_t stamp, uint8_t bus, const uint8_t *p, int len) {
+  printf("%10u %u ", stamp, bus);
+  switch (type) {
+    case MD_TELEM_LOG: {
+      if (len < 3 || p[2] > len - 3) {
+        printf("LOG short\n");
+        return;
+      }
+      printf("%c %-6s", p[0] < 5 ? _levels[p[0]] : '?',
+        p[1] < sizeof(_tags) / sizeof(_tags[0]) ? _tags[p[1]] : "?");
+      for (int i = 0; i < p[2]; i++)
+        printf(" %02x", p[3 + i]);
+      printf("\n");
+      break;
+    }
+    case MD_TELEM_EVENT:
+      if (len < 3) {
+        printf("EVENT short\n");
+        return;
+      }
+      printf("EVENT %s", p[0] < sizeof(_events) / sizeof(_events[0]) ? _events[p[0]] : "?");
+      if (p[0] == MD_EVENT_TEXT)
+        printf(" \"%.*s\"\n", len - 3, (const char *)&p[3]);
+      else
+        printf(" %u (was %u)\n", p[1], p[2]);
+      break;
+    case MD_TELEM_COUNTERS: {
+      md_telem_counters_t c;
+      if (len < (int)sizeof(c)) {
+        printf("COUNTERS short\n");
+        return;
+      }
+      memcpy(&c, p, sizeof(c));
+      printf("COUNTERS frames %u nops %u not_ready %u bus_avail %u truncated %u parity %u "
+        "resets %u timeouts %u ring_dropped %u log_dropped %u records %u\n",
+        c.frames, c.nops, c.not_ready, c.bus_avail, c.truncated, c.parity_errors,
+        c.resets_mid_byte, c.line_timeouts, c.ring_dropped, c.log_dropped, c.telem_records);
+      break;
+    }
+    default:
+      printf("type %u, %d bytes\n", type, len);
+  }
+}
+
+// one record off the wire, without its 0
+static void _handle(const uint8_t *wire, uint16_t len) {
+  uint8_t rec[MD_TELEM_WIRE_MAX];
+  uint16_t rec_len = md_telem_cobs_decode(wire, len, rec);
+  if (!rec_len) {
+    _totals.bad_cobs++;
+    return;
+  }
+
+  uint8_t type, bus;
+  uint32_t stamp;
+  const uint8_t *payload;
+  int payload_len = md_telem_parse(rec, rec_len, &type, &stamp, &bus, &payload);
+  if (payload_len < 0) {
+    _totals.bad_crc++;
+    return;
+  }
+
+  _totals.records++;
+  if (type <= MD_TELEM_COUNTERS)
+    _totals.by_type[type]++;
+  if (!_quiet)
+    _print_record(type, stamp, bus, payload, payload_len);
+}
+
+static void _open_tty(int fd, int baud) {
+  struct termios tio;
+  if (tcgetattr(fd, &tio))
+    return;
+  cfmakeraw(&tio);
+  speed_t speed = baud == 9600 ? B9600 : baud == 57600 ? B57600 : baud == 230400 ? B230400 : B115200;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  tcsetattr(fd, TCSANOW, &tio);
+}
+
+static void _on_signal(int) {
+  _stop = 1;
+}
+
+int main(int argc, char **argv) {
+  int baud = 115200;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "qb:")) != -1) {
+    switch (opt) {
+      case 'q':
+        _quiet = true;
+        break;
+      case 'b':
+        baud = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-q] [-b baud] tty|file|-\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-q] [-b baud] tty|file|-\n", argv[0]);
+    return 1;
+  }
+
+  int fd = strcmp(argv[optind], "-") ? open(argv[optind], O_RDONLY | O_NOCTTY) : 0;
+  if (fd < 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+  if (isatty(fd))
+    _open_tty(fd, baud);
+  signal(SIGINT, _on_signal);
+
+  // gather up to the next 0. Anything longer than a record can be isn't ours
+  uint8_t wire[MD_TELEM_WIRE_MAX];
+  uint16_t wire_len = 0;
+  bool overrun = false;
+  uint8_t buf[4096];
+  ssize_t n;
+  while (!_stop && (n = read(fd, buf, sizeof(buf))) > 0) {
+    _totals.bytes += n;
+    for (ssize_t i = 0; i < n; i++) {
+      if (buf[i]) {
+        if (wire_len < sizeof(wire))
+          wire[wire_len++] = buf[i];
+        else
+          overrun = true;
+        continue;
+      }
+      if (overrun)
+        _totals.overruns++;
+      else if (wire_len)
+        _handle(wire, wire_len);
+      wire_len = 0;
+      overrun = false;
+    }
+  }
+  if (fd)
+    close(fd);
+
+  fprintf(stderr, "%lu bytes, %lu records: LOG %lu EVENT %lu COUNTERS %lu, bad crc %lu, bad cobs %lu, overruns %lu\n",
+    _totals.bytes, _totals.records, _totals.by_type[MD_TELEM_LOG], _totals.by_type[MD_TELEM_EVENT],
+    _totals.by_type[MD_TELEM_COUNTERS], _totals.bad_crc, _totals.bad_cobs, _totals.overruns);
+  return 0;
+}
@@ -0,0 +1,437 @@
+/*
+ * Sony MD Remote trace analyser
+ * Barry Carter 2022 <barry.carter@gmail.com>
+ *
+ * md_trace_decode for big captures. The file is mmap'd, cut into chunks
+ * at reset pulses (a frame always starts with one, so the decoder can
+ * pick up from any of them) and the chunks are decoded on all the cores.
+ * Each thread runs the real receiver and state handler on its own
+ * md_bus_t, so MD_BUS_TLS has to be thread_local for the whole build.
+ *
+ * Each chunk starts decoding MD_ANALYSE_WARMUP resets early, with nothing
+ * counted, so the receiver is in step by the time its own frames start.
+ * The state and text can go back any distance though, so the threads only
+ * keep the good frames. The main thread puts them through one state
+ * handler in order as the chunks come in, which is quick next to finding
+ * them in the edges, and the timeline comes from that. The output is the
+ * same whatever the chunk size or thread count, tools/md_check_analyse.sh
+ * checks it is.
+ *
+ * Build from the top of the repo:
+ *  g++ -O2 -std=gnu++17 -pthread -Itools/host -DDUMP_MD_PACKET=0 -DMD_LOG_LEVEL=0 \
+ *      -DMD_BUS_TLS=thread_local -o md_trace_analyse \
+ *      tools/md_trace_analyse.cpp tools/host/Arduino.cpp src/[a-z]*.cpp
+ *
+ * Usage:
+ *  md_trace_analyse [-j threads] [-k chunk_kb] [-s] [-d] [-f cmd]... capture.mde|trace.csv
+ *   -j  how many threads, all the cores by default
+ *   -k  how much of the file each chunk gets, 4096K by default
+ *   -s  print the state timeline, i.e. every value that changes
+ *   -d  dump every frame
+ *   -f  only dump frames for this command (hex, e.g. -f c8). Give it more than once for more
+ */
+#ifndef MD_BUS_TLS
+#define MD_BUS_TLS thread_local
+#endif
+#include "../src/sony_md_remote.h"
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// how many resets before its start a chunk starts decoding from
+#define MD_ANALYSE_WARMUP 4
+
+static const char *_status_names[] = {
+  "NONE", "OK", "NOP", "NOT_READY", "BUS_AVAIL", "TRUNCATED", "BAD_PARITY",
+};
+
+static const char *_event_names[] = {
+  "BACKLIGHT", "VOLUME", "PLAY_MODE", "REC_INDICATOR", "BATTERY",
+  "EQ", "ALARM", "TRACK", "PLAY_STATE", "TEXT",
+};
+
+// where a reader is in the file
+typedef struct md_trace_pos_t {
+  size_t offset;
+  uint64_t ticks;                 // capture only, since the start
+  uint64_t idle;                  // capture only, to add to the next delta
+  uint64_t us;                    // since the start
+  uint8_t level;                  // capture only, the line right now
+} md_trace_pos_t;
+
+typedef struct md_trace_reader_t {
+  const uint8_t *data;
+  size_t size;
+  bool capture;
+  uint32_t clock_hz;
+  md_trace_pos_t pos;
+  unsigned long lost;
+} md_trace_reader_t;
+
+// a good frame, for the state handler. Any dump lines before out_at in the
+// chunk's output go first
+typedef struct md_chunk_frame_t {
+  uint64_t us;
+  size_t out_at;
+  uint8_t data[10];
+} md_chunk_frame_t;
+
+// a chunk of the file, and what came of it
+typedef struct md_chunk_t {
+  md_trace_pos_t warm;            // where to start decoding
+  size_t start;                   // frames completed by edges after this
+  size_t end;                     // up to and including this one are ours
+  bool first;                     // the first chunk counts everything
+  // results
+  unsigned long edges;
+  unsigned long status[MD_FRAME_BAD_PARITY + 1];
+  unsigned long cmds[256];
+  std::vector<md_chunk_frame_t> frames;
+  std::string out;
+  bool done;
+} md_chunk_t;
+
+typedef struct md_analyse_opts_t {
+  bool timeline;
+  bool dump;
+  bool filter;
+  bool cmds[256];
+} md_analyse_opts_t;
+
+static md_analyse_opts_t _opts;
+
+// what the thread is decoding right now
+typedef struct md_analyse_ctx_t {
+  md_chunk_t *chunk;
+  bool counting;
+  uint64_t us;
+} md_analyse_ctx_t;
+
+static thread_local md_analyse_ctx_t _ctx;
+
+// the main thread's state handler, and the frame it has
+static uint64_t _state_us;
+static unsigned long _events[MD_EVENT_TEXT + 1];
+
+static bool _md_trace_next(md_trace_reader_t *r, uint8_t *level, unsigned long *duration) {
+  if (!r->capture) {
+    // "-N," or "+N,", ignoring anything else
+    const uint8_t *p = r->data + r->pos.offset;
+    const uint8_t *end = r->data + r->size;
+    while (p < end) {
+      int sign = *p == '-' ? -1 : *p == '+' ? 1 : 0;
+      p++;
+      if (!sign || p >= end || *p < '0' || *p > '9')
+        continue;
+      unsigned long val = 0;
+      while (p < end && *p >= '0' && *p <= '9')
+        val = val * 10 + (*p++ - '0');
+      r->pos.offset = p - r->data;
+      r->pos.us += val;
+      *level = sign < 0 ? HIGH : LOW;
+      *duration = val;
+      return true;
+    }
+    r->pos.offset = r->size;
+    return false;
+  }
+
+  const uint8_t *p = r->data + r->pos.offset;
+  const uint8_t *end = r->data + r->size;
+  uint32_t delta;
+  while (md_cap_get_varint(&p, end, &delta)) {
+    if (!delta) {
+      if (p >= end)
+        break;
+      uint8_t esc = *p++;
+      uint32_t val;
+      if (!md_cap_get_varint(&p, end, &val))
+        break;
+      if (esc == MD_CAP_ESC_IDLE) {
+        r->pos.idle += val;
+      } else if (esc == MD_CAP_ESC_LOST && p < end) {
+        r->lost += val;
+        r->pos.level = !*p++;
+      }
+      continue;
+    }
+    r->pos.ticks += r->pos.idle + delta;
+    r->pos.idle = 0;
+    uint64_t now_us = r->pos.ticks * 1000000 / r->clock_hz;
+    r->pos.level = !r->pos.level;
+    *level = r->pos.level;
+    *duration = now_us - r->pos.us;
+    r->pos.us = now_us;
+    r->pos.offset = p - r->data;
+    return true;
+  }
+  r->pos.offset = r->size;
+  return false;
+}
+
+static bool _md_trace_is_reset(uint8_t level, unsigned long duration) {
+  return level == HIGH && duration > RESET_LOW_US_MIN && duration < RESET_LOW_US_MAX;
+}
+
+// One quick pass over the file, cutting it up at resets about chunk_bytes apart
+static void _md_trace_split(md_trace_reader_t *r, size_t chunk_bytes, std::vector<md_chunk_t> &chunks) {
+  md_trace_pos_t resets[MD_ANALYSE_WARMUP];
+  unsigned long reset_count = 0;
+  md_trace_pos_t before = r->pos;
+  uint8_t level;
+  unsigned long duration;
+
+  chunks.emplace_back();
+  chunks.back().warm = r->pos;
+  chunks.back().first = true;
+  while (_md_trace_next(r, &level, &duration)) {
+    if (_md_trace_is_reset(level, duration)) {
+      if (before.offset - chunks.back().start >= chunk_bytes && before.offset > chunks.back().start) {
+        chunks.back().end = before.offset;
+        chunks.emplace_back();
+        // the oldest reset we still know about
+        chunks.back().warm = reset_count < MD_ANALYSE_WARMUP ? chunks.front().warm : resets[reset_count % MD_ANALYSE_WARMUP];
+        chunks.back().start = before.offset;
+      }
+      resets[reset_count++ % MD_ANALYSE_WARMUP] = before;
+    }
+    before = r->pos;
+  }
+  chunks.back().end = r->size;
+}
+
+static void _md_analyse_event(const md_event_t *event, void *) {
+  _events[event->type]++;
+  if (!_opts.timeline)
+    return;
+  if (event->type == MD_EVENT_TEXT)
+    printf("%12llu %-13s \"%.*s\"\n", (unsigned long long)_state_us,
+      _event_names[event->type], event->text_len > 64 ? 64 : event->text_len, event->text);
+  else
+    printf("%12llu %-13s %u (was %u)\n", (unsigned long long)_state_us,
+      _event_names[event->type], event->value, event->prev);
+}
+
+static void _md_analyse_frame(int8_t status) {
+  md_chunk_t *chunk = _ctx.chunk;
+  chunk->status[status]++;
+  uint8_t len;
+  uint8_t *frame = md_recv_get_frame(&len);
+  if (status == MD_FRAME_OK) {
+    chunk->cmds[frame[2]]++;
+    md_chunk_frame_t f = { _ctx.us, chunk->out.size(), {} };
+    memcpy(f.data, &frame[2], sizeof(f.data));
+    chunk->frames.push_back(f);
+  }
+  if (!_opts.dump || (_opts.filter && (len < 3 || !_opts.cmds[frame[2]])))
+    return;
+
+  char line[128];
+  int n = snprintf(line, sizeof(line), "%12llu %-10s", (unsigned long long)_ctx.us, _status_names[status]);
+  for (int i = 0; i < len && n < (int)sizeof(line) - 4; i++)
+    n += snprintf(&line[n], sizeof(line) - n, " %02x", frame[i]);
+  line[n++] = '\n';
+  line[n] = 0;
+  chunk->out += line;
+}
+
+static void _md_analyse_chunk(const md_trace_reader_t *file, md_chunk_t *chunk) {
+  md_trace_reader_t r = *file;
+  r.pos = chunk->warm;
+
+  // a bus of our own, with nothing on it from the last chunk. What its
+  // state handler makes of the frames doesn't matter, the main thread's does
+  md_bus_t *bus = new md_bus_t();
+  md_bus_select(bus);
+  md_recv_set_passive(true);
+  _ctx.chunk = chunk;
+
+  uint8_t level;
+  unsigned long duration;
+  while (r.pos.offset <= chunk->end) {
+    size_t offset = r.pos.offset;
+    if (!_md_trace_next(&r, &level, &duration))
+      break;
+    // the edge at the start finishes the last chunk's frame, so that one isn't ours
+    _ctx.counting = chunk->first || offset > chunk->start;
+    _ctx.us = r.pos.us;
+    if ((chunk->first || offset >= chunk->start) && offset < chunk->end)
+      chunk->edges++;
+    int8_t status = md_recv_edge(level, duration);
+    if (status != MD_FRAME_NONE && _ctx.counting)
+      _md_analyse_frame(status);
+  }
+
+  md_bus_select(&md_bus_default);
+  delete bus;
+}
+
+int main(int argc, char **argv) {
+  unsigned threads = std::thread::hardware_concurrency();
+  size_t chunk_kb = 4096;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:k:sdf:")) != -1) {
+    switch (opt) {
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      case 'k':
+        chunk_kb = atoi(optarg);
+        break;
+      case 's':
+        _opts.timeline = true;
+        break;
+      case 'd':
+        _opts.dump = true;
+        break;
+      case 'f':
+        _opts.dump = true;
+        _opts.filter = true;
+        _opts.cmds[strtoul(optarg, NULL, 16) & 0xFF] = true;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-j threads] [-k chunk_kb] [-s] [-d] [-f cmd]... capture\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-j threads] [-k chunk_kb] [-s] [-d] [-f cmd]... capture\n", argv[0]);
+    return 1;
+  }
+  if (!threads)
+    threads = 1;
+  if (!chunk_kb)
+    chunk_kb = 1;
+
+  int fd = open(argv[optind], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st)) {
+    perror(argv[optind]);
+    return 1;
+  }
+  if (!st.st_size) {
+    fprintf(stderr, "%s is empty\n", argv[optind]);
+    return 1;
+  }
+  const uint8_t *data = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+  md_trace_reader_t file = {};
+  file.data = data;
+  file.size = st.st_size;
+  md_cap_header_t header;
+  if (file.size >= sizeof(header) && !memcmp(data, MD_CAP_MAGIC, 4)) {
+    memcpy(&header, data, sizeof(header));
+    if (header.version != MD_CAP_VERSION || !header.clock_hz) {
+      fprintf(stderr, "capture version %u, or clock %u, isn't something we know\n", header.version, header.clock_hz);
+      return 1;
+    }
+    file.capture = true;
+    file.clock_hz = header.clock_hz;
+    file.pos.offset = sizeof(header);
+    file.pos.level = header.level;
+  }
+
+  // the state all the way through, on this thread's bus
+  md_recv_set_passive(true);
+  md_event_subscribe(MD_EVENT_ALL, _md_analyse_event, NULL);
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<md_chunk_t> chunks;
+  md_trace_reader_t split = file;
+  _md_trace_split(&split, chunk_kb * 1024, chunks);
+  auto split_end = std::chrono::steady_clock::now();
+
+  // the workers take the next chunk going, the main thread prints them in order
+  std::atomic<size_t> next(0);
+  std::mutex lock;
+  std::condition_variable done;
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&]() {
+      size_t i;
+      while ((i = next++) < chunks.size()) {
+        _md_analyse_chunk(&file, &chunks[i]);
+        std::lock_guard<std::mutex> hold(lock);
+        chunks[i].done = true;
+        done.notify_all();
+      }
+    });
+  }
+
+  unsigned long edges = 0;
+  unsigned long status[MD_FRAME_BAD_PARITY + 1] = { 0 };
+  unsigned long cmds[256] = { 0 };
+  for (md_chunk_t &chunk : chunks) {
+    {
+      std::unique_lock<std::mutex> hold(lock);
+      done.wait(hold, [&]() { return chunk.done; });
+    }
+    // each frame's changes come before its dump line
+    size_t out_at = 0;
+    for (const md_chunk_frame_t &f : chunk.frames) {
+      fwrite(chunk.out.data() + out_at, 1, f.out_at - out_at, stdout);
+      out_at = f.out_at;
+      _state_us = f.us;
+      uint8_t data[10];
+      memcpy(data, f.data, sizeof(data));
+      md_packet_parse(data);
+    }
+    fwrite(chunk.out.data() + out_at, 1, chunk.out.size() - out_at, stdout);
+    std::string().swap(chunk.out);
+    std::vector<md_chunk_frame_t>().swap(chunk.frames);
+    edges += chunk.edges;
+    for (int i = 0; i <= MD_FRAME_BAD_PARITY; i++)
+      status[i] += chunk.status[i];
+    for (int i = 0; i < 256; i++)
+      cmds[i] += chunk.cmds[i];
+  }
+  for (std::thread &w : workers)
+    w.join();
+  auto end = std::chrono::steady_clock::now();
+
+  unsigned long frames = 0;
+  for (int i = 1; i <= MD_FRAME_BAD_PARITY; i++)
+    frames += status[i];
+  printf("%lu edges, %lu frames:", edges, frames);
+  for (int i = 1; i <= MD_FRAME_BAD_PARITY; i++)
+    printf(" %s %lu", _status_names[i], status[i]);
+  printf("\n");
+  if (split.lost)
+    printf("%lu edges lost in the capture\n", split.lost);
+
+  printf("frames by command:\n");
+  for (int i = 0; i < 256; i++) {
+    if (cmds[i])
+      printf("  %02x %10lu\n", i, cmds[i]);
+  }
+  printf("changes:");
+  for (int i = 0; i <= MD_EVENT_TEXT; i++) {
+    if (_events[i])
+      printf(" %s %lu", _event_names[i], _events[i]);
+  }
+  printf("\n");
+
+  double secs = std::chrono::duration<double>(end - start).count();
+  double split_secs = std::chrono::duration<double>(split_end - start).count();
+  fprintf(stderr, "%zu chunks on %u threads, %.1f MB in %.3f s (split %.3f s), %.0f MB/s, %.0f edges/s, %.0fx realtime\n",
+    chunks.size(), threads, file.size / 1e6, secs, split_secs, file.size / 1e6 / secs, edges / secs,
+    split.pos.us / 1e6 / secs);
+
+  munmap((void *)data, st.st_size);
+  close(fd);
+  return 0;
+}
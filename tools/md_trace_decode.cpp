@@ -0,0 +1,472 @@
+/*
+ * Sony MD Remote trace decoder
+ * Barry Carter 2022 <barry.carter@gmail.com>
+ *
+ * Runs the real receiver (src/protocol_decoder.cpp) and state handler
+ * over a recorded pulse trace on Linux, no Teensy or player needed.
+ *
+ * The trace is what GenericProtocolPoller dumps. Either its binary capture
+ * (see src/sony_md_capture.h), or the csv, i.e. "#-123,+45,..."
+ *  -N  the line was low for N us, then went high
+ *  +N  the line was high for N us, then went low
+ *
+ * Build from the top of the repo:
+ *  g++ -O2 -std=gnu++17 -Itools/host -DDUMP_MD_PACKET=0 -DMD_RECV_CALIBRATE=1 -o md_trace_decode \
+ *      tools/md_trace_decode.cpp tools/host/Arduino.cpp src/[a-z]*.cpp
+ *
+ * Usage:
+ *  md_trace_decode [-q] [-s] [-c] [-a] [-t] [-b passes] [-p] trace.csv|capture.mde
+ *   -q  don't print the frames, just the totals
+ *   -s  print the decoded state after each good frame
+ *   -c  keep calibrating the receive thresholds, and print where they ended up
+ *   -a  count heap allocations made by the library while decoding, logging
+ *       included. Fails if there are any. Build with -DDUMP_MD_PACKET=1 to log everything
+ *   -t  write the frames and state out as telemetry (see sony_md_telemetry.h)
+ *       on stdout, for md_telemetry_recv. The totals go to stderr
+ *   -b  benchmark. decode the trace this many times and report frames/sec
+ *   -p  play the trace out on a simulated data pin (see tools/host/Arduino.cpp)
+ *       and let md_recv_loop() read it like it would the real one. That's
+ *       _gather_packets() polling it, or the pin change interrupt with
+ *       -DMD_RECV_USE_ISR=1. The frames should be the same as without -p,
+ *       only the times differ. tools/md_check_recv.sh checks they are
+ */
+#include "../src/sony_md_remote.h"
+#include <vector>
+#include <chrono>
+#include <unistd.h>
+#include <time.h>
+#include <new>
+
+typedef struct md_trace_edge {
+  uint8_t level;
+  unsigned long duration;
+} md_trace_edge;
+
+static const char *_status_names[] = {
+  "NONE", "OK", "NOP", "NOT_READY", "BUS_AVAIL", "TRUNCATED", "BAD_PARITY",
+};
+
+static bool _show_state;
+
+// -a. Only counts while the library has control, the tool itself is free to allocate
+static bool _count_allocs;
+static unsigned long _allocs;
+
+void *operator new(size_t size) {
+  if (_count_allocs)
+    _allocs++;
+  void *p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+// the log records, drained into nothing
+static unsigned long _log_records;
+static void _count_log(const md_log_record_t *) {
+  _log_records++;
+}
+
+// Titles longer than the ring. It's read out as it fills, then put back
+// together for the TEXT line
+static char _text[1024];
+static uint16_t _text_len;
+
+static void _text_drain() {
+  md_text_store_t *rx = &md_bus_current()->proto.rx_text;
+  if (rx->pages == MD_TEXT_POOL_PAGES && !rx->closed)
+    _text_len += md_text_read(_text + _text_len, sizeof(_text) - 1 - _text_len);
+}
+
+// a new track, whatever was read out of the last one's title is no good
+static void _text_track(const md_event_t *, void *) {
+  _text_len = 0;
+}
+
+// the csv GenericProtocolPoller used to dump. All of the pulses, ignoring anything else on the line
+static void _load_csv(const std::vector<uint8_t> &raw, std::vector<md_trace_edge> &edges) {
+  int sign = 0;
+  unsigned long val = 0;
+  bool have_digits = false;
+  for (size_t i = 0; i <= raw.size(); i++) {
+    // one more time round, to finish off a number right at the end
+    int c = i < raw.size() ? raw[i] : EOF;
+    if (c >= '0' && c <= '9' && sign) {
+      val = val * 10 + (c - '0');
+      have_digits = true;
+      continue;
+    }
+
+    // end of a number
+    if (sign && have_digits)
+      edges.push_back({ (uint8_t)(sign < 0 ? HIGH : LOW), val });
+
+    sign = 0;
+    val = 0;
+    have_digits = false;
+    if (c == '-')
+      sign = -1;
+    else if (c == '+')
+      sign = 1;
+  }
+}
+
+// the binary capture, see sony_md_capture.h
+static bool _load_capture(const std::vector<uint8_t> &raw, std::vector<md_trace_edge> &edges) {
+  md_cap_header_t header;
+  if (raw.size() < sizeof(header))
+    return false;
+  memcpy(&header, raw.data(), sizeof(header));
+  if (header.version != MD_CAP_VERSION || !header.clock_hz) {
+    fprintf(stderr, "capture version %u, or clock %u, isn't something we know\n", header.version, header.clock_hz);
+    return false;
+  }
+
+  // ticks since the start, and the us that came to, so the rounding doesn't add up
+  uint64_t ticks = 0;
+  uint64_t us = 0;
+  uint64_t idle = 0;
+  uint8_t level = header.level;
+  unsigned long lost = 0;
+  const uint8_t *p = raw.data() + sizeof(header);
+  const uint8_t *end = raw.data() + raw.size();
+  uint32_t delta;
+  while (md_cap_get_varint(&p, end, &delta)) {
+    if (!delta) {
+      if (p >= end)
+        break;
+      uint8_t esc = *p++;
+      uint32_t val;
+      if (!md_cap_get_varint(&p, end, &val))
+        break;
+      if (esc == MD_CAP_ESC_IDLE) {
+        idle += val;
+      } else if (esc == MD_CAP_ESC_LOST && p < end) {
+        lost += val;
+        // so the next edge lands on the level it says
+        level = !*p++;
+      }
+      continue;
+    }
+
+    ticks += idle + delta;
+    idle = 0;
+    uint64_t now_us = ticks * 1000000 / header.clock_hz;
+    level = !level;
+    edges.push_back({ level, (unsigned long)(now_us - us) });
+    us = now_us;
+  }
+
+  time_t start = header.start_time;
+  char when[32] = "unknown time";
+  if (start)
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime(&start));
+  fprintf(stderr, "capture of pin %u at %uHz from %s, %.3fs, %lu edges lost\n", header.pin, header.clock_hz,
+    when, us / 1e6, lost);
+  return true;
+}
+
+// a capture, or a csv
+static bool _load_trace(const char *path, std::vector<md_trace_edge> &edges) {
+  FILE *f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+  if (!f) {
+    perror(path);
+    return false;
+  }
+
+  std::vector<uint8_t> raw;
+  uint8_t buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    raw.insert(raw.end(), buf, buf + n);
+  if (f != stdin)
+    fclose(f);
+
+  if (raw.size() >= 4 && !memcmp(raw.data(), MD_CAP_MAGIC, 4))
+    return _load_capture(raw, edges);
+  _load_csv(raw, edges);
+  return true;
+}
+
+// @returns the number of frames completed
+static unsigned long _decode(const std::vector<md_trace_edge> &edges, bool quiet,
+                             unsigned long *status_count) {
+  unsigned long frames = 0;
+  unsigned long long t = 0;
+
+  for (const md_trace_edge &e : edges) {
+    t += e.duration;
+    _count_allocs = true;
+    int8_t status = md_recv_edge(e.level, e.duration);
+    md_log_drain();
+    _count_allocs = false;
+    _text_drain();
+    if (status == MD_FRAME_NONE)
+      continue;
+
+    frames++;
+    status_count[status]++;
+    if (quiet)
+      continue;
+
+    uint8_t len;
+    uint8_t *frame = md_recv_get_frame(&len);
+    printf("%12llu %-10s", t, _status_names[status]);
+    for (int i = 0; i < len; i++)
+      printf(" %02x", frame[i]);
+    printf("\n");
+
+    if (_show_state && status == MD_FRAME_OK)
+      md_display();
+  }
+  return frames;
+}
+
+// -p. What the player end of the wire plays out
+static const std::vector<md_trace_edge> *_play_edges;
+
+static void _play_setup() {
+  pinMode(MD_DATA_PIN, OUTPUT);
+  digitalWrite(MD_DATA_PIN, !(*_play_edges)[0].level);
+}
+
+static void _play_loop() {
+  for (const md_trace_edge &e : *_play_edges) {
+    delayMicroseconds(e.duration);
+    digitalWrite(MD_DATA_PIN, e.level);
+  }
+  // and that's all of it
+  while (1)
+    delay(1000);
+}
+
+static bool _play_quiet;
+static unsigned long _play_frames;
+static unsigned long _play_missed;
+
+static void _play_counts(uint32_t *counts) {
+  md_recv_stats_t stats;
+  md_recv_get_stats(&stats);
+  counts[MD_FRAME_OK] = stats.frames;
+  counts[MD_FRAME_NOP] = stats.nops;
+  counts[MD_FRAME_NOT_READY] = stats.not_ready;
+  counts[MD_FRAME_BUS_AVAIL] = stats.bus_avail;
+  counts[MD_FRAME_TRUNCATED] = stats.truncated;
+  counts[MD_FRAME_BAD_PARITY] = stats.parity_errors;
+}
+
+static void _recv_setup() {
+  md_recv_setup();
+}
+
+// the real loop, then print what it parsed, the same as _decode() would
+static void _recv_loop() {
+  uint32_t before[MD_FRAME_BAD_PARITY + 1] = { 0 }, after[MD_FRAME_BAD_PARITY + 1] = { 0 };
+  _play_counts(before);
+  md_recv_loop();
+  md_log_drain();
+  _text_drain();
+  _play_counts(after);
+
+  int8_t status = MD_FRAME_NONE;
+  unsigned long parsed = 0;
+  for (int8_t i = MD_FRAME_OK; i <= MD_FRAME_BAD_PARITY; i++) {
+    if (after[i] == before[i])
+      continue;
+    parsed += after[i] - before[i];
+    status = i;
+  }
+  if (!parsed)
+    return;
+  _play_frames += parsed;
+  // loop() comes round far more often than frames do, so this shouldn't happen
+  if (parsed > 1) {
+    _play_missed += parsed - 1;
+    fprintf(stderr, "%lu frames parsed in one md_recv_loop(), only the last is printed\n", parsed);
+  }
+  if (_play_quiet)
+    return;
+
+  uint8_t len;
+  uint8_t *frame = md_recv_get_frame(&len);
+  printf("%12lu %-10s", micros(), _status_names[status]);
+  for (int i = 0; i < len; i++)
+    printf(" %02x", frame[i]);
+  printf("\n");
+
+  if (_show_state && status == MD_FRAME_OK)
+    md_display();
+}
+
+// -p. @returns the number of frames parsed
+static unsigned long _play(const std::vector<md_trace_edge> &edges, bool quiet) {
+  if (edges.empty())
+    return 0;
+  unsigned long long trace_us = 0;
+  for (const md_trace_edge &e : edges)
+    trace_us += e.duration;
+
+  // a fixed seed, so it's the same every time
+  host_sim_opts_t opts;
+  opts.call_ns = 100;
+  opts.yield_ns = 2000;
+  opts.irq_ns = 500;
+  opts.irq_jitter_ns = 500;
+  opts.seed = 1;
+  host_sim_init(&opts);
+
+  _play_edges = &edges;
+  _play_quiet = quiet;
+  // the receiver comes up once the line is at its starting level
+  host_sim_ep_t *player = host_sim_add("player", _play_setup, _play_loop, 0);
+  host_sim_ep_t *recv = host_sim_add("recv", _recv_setup, _recv_loop, 1);
+  host_sim_wire_t *wire = host_sim_wire(NULL, player, MD_DATA_PIN, HOST_WIRE_FLOAT);
+  host_sim_wire(wire, recv, MD_DATA_PIN, HOST_WIRE_FLOAT);
+
+  // long enough for the last frame to time out
+  host_sim_run(trace_us + 2 * END_MSG_TIMEOUT_US + MD_RECV_POLL_BUDGET_US);
+  return _play_frames;
+}
+
+static void _print_thresholds(FILE *out) {
+  md_recv_thresholds_t t;
+  md_recv_get_thresholds(&t);
+  fprintf(out, "thresholds: 1 < %uus, reset %u-%uus, margin %uus from %u pulses\n",
+    t.pulse_on_us_min, t.reset_low_us_min, t.reset_low_us_max, t.margin_us, (unsigned)t.samples);
+}
+
+// only what hadn't been read out yet
+void md_text_received_cb(char *text, uint8_t) {
+  uint16_t len = strlen(text);
+  if (len > sizeof(_text) - 1 - _text_len)
+    len = sizeof(_text) - 1 - _text_len;
+  memcpy(_text + _text_len, text, len);
+  _text[_text_len + len] = 0;
+  _text_len = 0;
+  if (_show_state)
+    printf("TEXT: %s%s\n", _text, md_text_truncated() ? " (cut short)" : "");
+}
+
+int main(int argc, char **argv) {
+  bool quiet = false;
+  bool calibrate = false;
+  bool check_allocs = false;
+  bool telemetry = false;
+  bool play = false;
+  int passes = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "qscatb:p")) != -1) {
+    switch (opt) {
+      case 'q':
+        quiet = true;
+        break;
+      case 's':
+        _show_state = true;
+        break;
+      case 'c':
+        calibrate = true;
+        break;
+      case 'a':
+        check_allocs = true;
+        break;
+      case 't':
+        telemetry = true;
+        break;
+      case 'b':
+        passes = atoi(optarg);
+        break;
+      case 'p':
+        play = true;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-q] [-s] [-c] [-a] [-t] [-b passes] [-p] trace.csv\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s [-q] [-s] [-c] [-a] [-t] [-b passes] [-p] trace.csv\n", argv[0]);
+    return 1;
+  }
+  if (play && (check_allocs || telemetry || passes > 0)) {
+    fprintf(stderr, "-p doesn't go with -a, -t or -b\n");
+    return 1;
+  }
+
+  std::vector<md_trace_edge> edges;
+  if (!_load_trace(argv[optind], edges))
+    return 1;
+
+  // the log goes to the console, unless we are counting or it's telemetry
+  FILE *out = stdout;
+  if (telemetry) {
+    md_telem_setup();
+    quiet = true;
+    out = stderr;
+  } else if (check_allocs) {
+    md_log_set_sink(_count_log);
+  }
+
+  // we are only listening to a recording, never talk back
+  md_recv_set_passive(true);
+  md_event_subscribe(MD_EVENT_MASK(MD_EVENT_TRACK), _text_track, NULL);
+  if (calibrate) {
+#if !MD_RECV_CALIBRATE
+    fprintf(stderr, "-c needs the library built with -DMD_RECV_CALIBRATE=1\n");
+    return 1;
+#endif
+    md_recv_calibrate(true);
+  }
+
+  unsigned long status_count[MD_FRAME_BAD_PARITY + 1] = { 0 };
+
+  if (passes <= 0) {
+    unsigned long frames = play ? _play(edges, quiet) : _decode(edges, quiet, status_count);
+    md_recv_stats_t stats;
+    md_recv_get_stats(&stats);
+    if (telemetry) {
+      md_telem_send_counters();
+      fflush(stdout);
+    }
+    fprintf(out, "%zu edges, %lu frames: OK %u NOP %u NOT_READY %u BUS_AVAIL %u TRUNCATED %u BAD_PARITY %u\n",
+      edges.size(), frames, (unsigned)stats.frames, (unsigned)stats.nops, (unsigned)stats.not_ready,
+      (unsigned)stats.bus_avail, (unsigned)stats.truncated, (unsigned)stats.parity_errors);
+    fprintf(out, "resets mid byte %u, line timeouts %u, parse us min %u avg %u max %u\n",
+      (unsigned)stats.resets_mid_byte, (unsigned)stats.line_timeouts, (unsigned)stats.parse_us_min, (unsigned)stats.parse_us_avg, (unsigned)stats.parse_us_max);
+    if (calibrate)
+      _print_thresholds(out);
+    if (check_allocs) {
+      fprintf(out, "allocations while decoding %lu, log records %lu (%u dropped)\n",
+        _allocs, _log_records, (unsigned)md_log_get_dropped());
+      return _allocs ? 2 : 0;
+    }
+    return 0;
+  }
+
+  // the library chatters about bad packets. keep it out of the timing
+  Serial.muted = true;
+  unsigned long long trace_us = 0;
+  for (const md_trace_edge &e : edges)
+    trace_us += e.duration;
+
+  unsigned long frames = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < passes; i++)
+    frames += _decode(edges, true, status_count);
+  auto end = std::chrono::steady_clock::now();
+  Serial.muted = false;
+
+  double secs = std::chrono::duration<double>(end - start).count();
+  printf("%d passes, %lu frames, %zu edges in %.3f s\n", passes, frames, edges.size() * passes, secs);
+  printf("%.0f frames/sec, %.0f edges/sec, %.0fx realtime\n",
+    frames / secs, edges.size() * passes / secs, trace_us * passes / 1e6 / secs);
+  return 0;
+}
@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+# Sony MD Remote trace generator
+# Barry Carter 2022 <barry.carter@gmail.com>
+#
+# Makes up a player talking to a remote, as GenericProtocolPoller would
+# have captured it. Either its binary capture (src/sony_md_capture.h), or
+# with -c the csv it used to dump. For the tools, when there isn't a real
+# capture to hand. tools/traces/md_sample.mde came from
+#   md_trace_gen.py -n 4 -j 6 -b 7 > tools/traces/md_sample.mde
+#
+# Each round is a NOP, the track, the play mode, the title (-t) in 7 char
+# chunks and a display change. Nobody writes the header back. With -o the
+# track, play mode and display only go every so often, the way a player
+# mostly only says when something changes.
+#
+# Usage:
+#  md_trace_gen.py [-n rounds] [-j us] [-b N] [-s seed] [-t title] [-o N] [-c]
+#   -n  how many rounds, 1 by default
+#   -j  move every pulse up to this many us either way, at random
+#   -b  spoil every Nth frame with data in, bad parity and cut short in turn
+#   -s  seed for -j
+#   -t  the title, a round number in it as %d is filled in
+#   -o  the state only every Nth round, from the first
+#   -c  write the csv instead
+import sys
+import getopt
+import random
+import struct
+
+CLOCK_HZ = 600000000
+PIN = 3
+
+# line levels and how long for, in us
+pulses = []
+pending_high = [0]
+
+
+def high(us):
+    pending_high[0] += us
+
+
+def low(us):
+    pulses.append((1, pending_high[0]))
+    pending_high[0] = 0
+    pulses.append((0, us))
+
+
+def bit(b):
+    if b:
+        high(18 + 220)
+        low(18)
+    else:
+        high(18)
+        low(220)
+
+
+def byte(v, gap=80):
+    for i in range(8):
+        bit((v >> i) & 1)
+    high(gap)
+
+
+def frame(data=None, spoil=None):
+    high(30000)
+    low(1100)
+    high(1018)
+    # start bit
+    high(18)
+    low(220)
+    # header, the remote doesn't drive it so it reads as 0s
+    for i in range(8):
+        high(18)
+        low(238)
+    byte(0x80 if data else 0x81)
+    if not data:
+        return
+    parity = 0
+    for i, d in enumerate(data):
+        if spoil == 'short' and i == 5:
+            return
+        byte(d, 160)
+        parity ^= d
+    byte(parity ^ 0x01 if spoil == 'parity' else parity)
+
+
+def main():
+    rounds = 1
+    jitter = 0.0
+    spoil_every = 0
+    seed = 1
+    title = 'Paradise is Minidisc - Some Guy'
+    state_every = 1
+    csv = False
+    opts, args = getopt.getopt(sys.argv[1:], 'n:j:b:s:t:o:c')
+    for opt, val in opts:
+        if opt == '-n':
+            rounds = int(val)
+        elif opt == '-j':
+            jitter = float(val)
+        elif opt == '-b':
+            spoil_every = int(val)
+        elif opt == '-s':
+            seed = int(val)
+        elif opt == '-t':
+            title = val
+        elif opt == '-o':
+            state_every = int(val)
+        elif opt == '-c':
+            csv = True
+
+    data_frames = [0]
+
+    def data_frame(data):
+        data_frames[0] += 1
+        spoil = None
+        if spoil_every and data_frames[0] % spoil_every == 0:
+            spoil = 'parity' if (data_frames[0] // spoil_every) % 2 else 'short'
+        frame(data, spoil)
+
+    for k in range(rounds):
+        state = k % state_every == 0
+        frame()
+        if state:
+            data_frame([0xA0, 0, 0, 0, 0x12, 0, 0, 0, 0, 0])
+            data_frame([0x40, 5, 0, 0, 0, 0, 0, 0, 0, 0])
+        text = (title.replace('%d', str(k + 1)) if '%d' in title else title).encode() + b'\0'
+        for i in range(0, len(text), 7):
+            chunk = text[i:i + 7]
+            last = i + 7 >= len(text)
+            data_frame([0xC8, 1 if last else 2, 0] + list(chunk.ljust(7, b'\xff')))
+        if state:
+            data_frame([0x43, 0x7F, 0, 0, 0, 0, 0, 0, 0, 0])
+    high(30000)
+    low(10)
+
+    rnd = random.Random(seed)
+    if jitter:
+        pulses[:] = [(level, max(1, us + rnd.uniform(-jitter, jitter))) for level, us in pulses]
+
+    if csv:
+        # broken into lines the way the poller did
+        out = ['MD Raw\n']
+        line = ''
+        for level, us in pulses:
+            line += '%s%d,' % ('+' if level else '-', round(us))
+            if us > 6500:
+                out.append(line + '\n')
+                line = '#'
+        out.append(line + '\n')
+        sys.stdout.write(''.join(out))
+        return
+
+    # the line starts at the level of the first pulse, and flips on each edge
+    out = bytearray(struct.pack('<4sBBBBIII', b'MDE1', 1, PIN, pulses[0][0], 0, CLOCK_HZ, 0, 0))
+    ticks = 0
+    last = 0
+    for level, us in pulses:
+        ticks += us * CLOCK_HZ / 1000000
+        delta = round(ticks) - last
+        last += delta
+        while delta >= 0x80:
+            out.append((delta & 0x7F) | 0x80)
+            delta >>= 7
+        out.append(delta)
+    sys.stdout.buffer.write(out)
+
+
+if __name__ == '__main__':
+    main()